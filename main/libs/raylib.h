@@ -86,10 +86,14 @@
 #ifndef _RAYLIB_H_
 #define _RAYLIB_H_
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <esp_timer.h>
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "esp_heap_caps.h"
 
 // =================== CONFIG ===================
 
@@ -139,6 +143,25 @@
 
 #define SCREEN_BUFFER_SIZE (LCD_W * LCD_H * 2)
 
+// Panel lines per framebuffer row: 2 keeps a half-height framebuffer that is
+// line-doubled on present. With an odd LCD_H the last row is sent once.
+#ifndef FB_ROW_SCALE
+#define FB_ROW_SCALE 1
+#endif
+#define FB_H ((LCD_H + FB_ROW_SCALE - 1) / FB_ROW_SCALE)
+static_assert((LCD_H - 1) / FB_ROW_SCALE < FB_H, "the last panel line must map to a framebuffer row");
+
+// Bytes of internal RAM for render textures, taken on the first LoadRenderTexture
+#ifndef RENDER_TEXTURE_POOL
+#define RENDER_TEXTURE_POOL (64 * 1024)
+#endif
+#define RENDER_TEXTURE_MAX 8
+
+// Panel lines per SPI transaction when a color LUT is set or rows are doubled
+#ifndef PRESENT_STRIP_LINES
+#define PRESENT_STRIP_LINES 8
+#endif
+
 // GPIO predefined buttons
 #ifndef PIN_KEY_A
 #define PIN_KEY_A 0
@@ -167,6 +190,52 @@ typedef struct {
 
 static_assert(sizeof(Color) == 2, "Color struct size should be 2 bytes");
 
+typedef struct Rectangle {
+    float x;
+    float y;
+    float width;
+    float height;
+} Rectangle;
+
+// Off-screen surfaces, raylib layout. Only render textures exist here, the
+// id indexes the surface pool (0 when the pool had no room).
+typedef struct Texture {
+    unsigned int id;
+    int width;
+    int height;
+    int mipmaps;
+    int format;
+} Texture;
+typedef Texture Texture2D;
+
+typedef struct RenderTexture {
+    unsigned int id;
+    Texture texture;
+    Texture depth;
+} RenderTexture;
+typedef RenderTexture RenderTexture2D;
+
+// RGB565 -> RGB565 transform applied by EndDrawing while the frame is sent.
+// Every channel value maps to an RGB565 contribution and the three are
+// summed, so any per-channel curve works, and mixes as long as the weights
+// landing in one channel add up to at most 1.
+typedef struct {
+    uint16_t r[32];
+    uint16_t g[64];
+    uint16_t b[32];
+} ColorLut;
+
+// Monospaced 1-bit font as assets_packer emits it (same guard as assets.h),
+// set with SetTextFont.
+#ifndef BITMAP_FONT_TYPE
+#define BITMAP_FONT_TYPE
+typedef struct {
+    const uint16_t *glyphs; // w column masks per glyph, bit y set where row y is lit
+    int first, count;       // character codes covered
+    int w, h;               // cell size, spacing included
+} BitmapFont;
+#endif
+
 #define LIGHTGRAY CLITERAL(Color){25, 50, 25}   // Light Gray
 #define GRAY CLITERAL(Color){16, 33, 16}        // Gray
 #define DARKGRAY CLITERAL(Color){10, 20, 10}    // Dark Gray
@@ -192,6 +261,7 @@ static_assert(sizeof(Color) == 2, "Color struct size should be 2 bytes");
 #define WHITE CLITERAL(Color){31, 63, 31}       // White
 #define BLACK CLITERAL(Color){0, 0, 0}          // Black
 #define MAGENTA CLITERAL(Color){31, 0, 31}      // Magenta
+#define BLANK CLITERAL(Color){31, 1, 31}        // No alpha: the colorkey DrawTextureKeyed skips
 #define RAYWHITE CLITERAL(Color){30, 61, 30}    // My own White (raylib logo)
 
 typedef enum {
@@ -327,7 +397,36 @@ static int64_t frame_start_time_us = 0;
 static int target_fps = 30;
 static int64_t target_frame_time_us = 1000000 / 30;
 
-FB_ATTR uint16_t framebuffer[LCD_W * LCD_H];
+FB_ATTR uint16_t framebuffer[LCD_W * FB_H] __attribute__((aligned(4)));
+
+// what the Draw functions write to: the framebuffer, or a render texture
+// between BeginTextureMode and EndTextureMode
+static uint16_t *draw_target = framebuffer;
+static int draw_w = LCD_W;
+static int draw_h = FB_H;
+
+static const ColorLut *present_lut = NULL;
+static const BitmapFont *text_font = NULL;
+static uint16_t present_strip[2][LCD_W * PRESENT_STRIP_LINES] __attribute__((aligned(4)));
+static uint8_t present_dirty[LCD_W]; // columns to send, see PresentColumns
+static bool present_partial = false;
+
+// Not in raylib: work done by the shim since the caller last reset it, only
+// counted when COST_COUNTERS is defined.
+typedef struct {
+    uint32_t rects;     // DrawRectangle calls
+    uint32_t pixels;    // pixels written to the framebuffer or a render texture
+    uint32_t spi_bytes; // commands and pixels sent to the panel
+    uint32_t idle_cycles; // CPU cycles EndDrawing slept to hold the frame rate
+} ShimCost;
+
+#ifdef COST_COUNTERS
+#include "esp_cpu.h"
+ShimCost shim_cost;
+#define SHIM_COST_ADD(field, n) (shim_cost.field += (n))
+#else
+#define SHIM_COST_ADD(field, n) ((void)0)
+#endif
 
 // write a 16-bit value to an address in IRAM, handling unaligned accesses
 static inline void write_u16_iram(uint16_t *addr, uint16_t val) {
@@ -351,6 +450,7 @@ static void lcd_cmd(uint8_t cmd) {
     t.length = 8;
     t.tx_buffer = &cmd;
     spi_device_polling_transmit(spi, &t);
+    SHIM_COST_ADD(spi_bytes, 1);
 }
 
 static void lcd_data(const void *data, int len_bytes) {
@@ -360,6 +460,7 @@ static void lcd_data(const void *data, int len_bytes) {
     t.length = len_bytes * 8;
     t.tx_buffer = data;
     spi_device_polling_transmit(spi, &t);
+    SHIM_COST_ADD(spi_bytes, len_bytes);
 }
 
 static void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
@@ -464,18 +565,106 @@ uint16_t ColorToInt(Color c) {
     return (uc >> 8) | (uc << 8);
 }
 
-void ClearBackground(Color color) {
-    uint16_t rgb565_color = ColorToInt(color);
-    for (int i = 0; i < LCD_W * LCD_H; i++) {
-        #ifdef FB_DRAM
-        framebuffer[i] = rgb565_color;
-        #else
-        write_u16_iram(&framebuffer[i], rgb565_color);
-        #endif
+static inline void fb_put(int i, uint16_t px) {
+    SHIM_COST_ADD(pixels, 1);
+    #ifdef FB_DRAM
+    draw_target[i] = px;
+    #else
+    write_u16_iram(&draw_target[i], px);
+    #endif
+}
+
+// n pixels from index i of the draw target, 32 bits at a time past the first odd one
+static inline void fb_fill(int i, int n, uint16_t px) {
+    if (n <= 0) return;
+    if (i & 1) {
+        fb_put(i++, px);
+        n--;
     }
+    SHIM_COST_ADD(pixels, n & ~1);
+    uint32_t pair = px | (uint32_t)px << 16;
+    uint32_t *dst = (uint32_t *)&draw_target[i];
+    for (int k = 0; k < n / 2; k++) dst[k] = pair;
+    if (n & 1) fb_put(i + n - 1, px);
+}
+
+// row y from x0 to x1 included, clamped to the draw target
+static inline void fb_hspan(int y, int x0, int x1, uint16_t px) {
+    if (y < 0 || y >= draw_h) return;
+    if (x0 < 0) x0 = 0;
+    if (x1 > draw_w - 1) x1 = draw_w - 1;
+    fb_fill(y * draw_w + x0, x1 - x0 + 1, px);
+}
+
+// Liang-Barsky against the draw target, false if nothing is left
+static bool fb_clip_line(float *x0, float *y0, float *x1, float *y1) {
+    float dx = *x1 - *x0, dy = *y1 - *y0;
+    float p[4] = {-dx, dx, -dy, dy};
+    float q[4] = {*x0, draw_w - 1 - *x0, *y0, draw_h - 1 - *y0};
+    float t0 = 0.0f, t1 = 1.0f;
+    for (int k = 0; k < 4; k++) {
+        if (p[k] == 0.0f) {
+            if (q[k] < 0.0f) return false;
+            continue;
+        }
+        float t = q[k] / p[k];
+        if (p[k] < 0.0f) {
+            if (t > t1) return false;
+            if (t > t0) t0 = t;
+        } else {
+            if (t < t0) return false;
+            if (t < t1) t1 = t;
+        }
+    }
+    float ox = *x0, oy = *y0;
+    *x0 = ox + t0 * dx;
+    *y0 = oy + t0 * dy;
+    *x1 = ox + t1 * dx;
+    *y1 = oy + t1 * dy;
+    return true;
+}
+
+// Bresenham, clipped once up front so the loop writes without bounds checks.
+// A line thicker than one pixel puts a span across its major axis at every
+// step instead of a pixel, spans are clamped to the draw target.
+static void fb_line(float fx0, float fy0, float fx1, float fy1, int thick, uint16_t px) {
+    int half = thick / 2;
+    if (!fb_clip_line(&fx0, &fy0, &fx1, &fy1)) return;
+    int x0 = (int)(fx0 + 0.5f), y0 = (int)(fy0 + 0.5f);
+    int x1 = (int)(fx1 + 0.5f), y1 = (int)(fy1 + 0.5f);
+    int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+    int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    bool x_major = dx >= -dy;
+    int err = dx + dy;
+    for (;;) {
+        if (thick <= 1) {
+            fb_put(y0 * draw_w + x0, px);
+        } else if (x_major) {
+            int from = y0 - half < 0 ? 0 : y0 - half;
+            int to = y0 - half + thick > draw_h ? draw_h : y0 - half + thick;
+            for (int y = from; y < to; y++) fb_put(y * draw_w + x0, px);
+        } else {
+            fb_hspan(y0, x0 - half, x0 - half + thick - 1, px);
+        }
+        if (x0 == x1 && y0 == y1) break;
+        int e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+void ClearBackground(Color color) {
+    fb_fill(0, draw_w * draw_h, ColorToInt(color));
 }
 
 void DrawRectangle(int posX, int posY, int width, int height, Color color) {
+    SHIM_COST_ADD(rects, 1);
     if (width <= 0 || height <= 0) return;
     
     // Clipping
@@ -487,20 +676,277 @@ void DrawRectangle(int posX, int posY, int width, int height, Color color) {
         height += posY;
         posY = 0;
     }
-    if (posX + width > LCD_W) width = LCD_W - posX;
-    if (posY + height > LCD_H) height = LCD_H - posY;
+    if (posX + width > draw_w) width = draw_w - posX;
+    if (posY + height > draw_h) height = draw_h - posY;
     if (width <= 0 || height <= 0) return;
 
     uint16_t rgb565_color = ColorToInt(color);
     
     for (int y = 0; y < height; y++) {
-        int lCD_offset = (posY + y) * LCD_W + posX;
-        for (int x = 0; x < width; x++) {
-            #ifdef FB_DRAM
-            framebuffer[lCD_offset + x] = rgb565_color;
-            #else
-            write_u16_iram(&framebuffer[lCD_offset + x], rgb565_color);
-            #endif
+        fb_fill((posY + y) * draw_w + posX, width, rgb565_color);
+    }
+}
+
+void DrawRectangleLines(int x, int y, int width, int height, Color color) {
+    if (width <= 0 || height <= 0) return;
+    DrawRectangle(x, y, width, 1, color);
+    DrawRectangle(x, y + height - 1, width, 1, color);
+    DrawRectangle(x, y + 1, 1, height - 2, color);
+    DrawRectangle(x + width - 1, y + 1, 1, height - 2, color);
+}
+
+void DrawLine(int startX, int startY, int endX, int endY, Color color) {
+    fb_line(startX, startY, endX, endY, 1, ColorToInt(color));
+}
+
+void DrawLineEx(Vector2 startPos, Vector2 endPos, float thick, Color color) {
+    fb_line(startPos.x, startPos.y, endPos.x, endPos.y, (int)(thick + 0.5f), ColorToInt(color));
+}
+
+// midpoint circle, filled with one span per row
+void DrawCircleV(Vector2 center, float radius, Color color) {
+    int cx = (int)(center.x + 0.5f), cy = (int)(center.y + 0.5f);
+    int r = (int)(radius + 0.5f);
+    if (cx + r < 0 || cx - r >= draw_w || cy + r < 0 || cy - r >= draw_h) return;
+    uint16_t px = ColorToInt(color);
+    int x = r, y = 0, d = 1 - r;
+    while (y <= x) {
+        fb_hspan(cy + y, cx - x, cx + x, px);
+        if (y) fb_hspan(cy - y, cx - x, cx + x, px);
+        if (d < 0) {
+            d += 2 * y + 3;
+        } else {
+            // rows at the top and bottom, once per x step
+            if (x != y) {
+                fb_hspan(cy + x, cx - y, cx + y, px);
+                fb_hspan(cy - x, cx - y, cx + y, px);
+            }
+            d += 2 * (y - x) + 5;
+            x--;
+        }
+        y++;
+    }
+}
+
+// Column of height rows down from (x, y), width pixels wide, one pixel per
+// row, already in the framebuffer format (see ColorToInt).
+void DrawColumn(int x, int y, int width, int height, const uint16_t *pixels) {
+    if (x < 0) {
+        width += x;
+        x = 0;
+    }
+    if (y < 0) {
+        height += y;
+        pixels -= y;
+        y = 0;
+    }
+    if (x + width > draw_w) width = draw_w - x;
+    if (y + height > draw_h) height = draw_h - y;
+    if (width <= 0 || height <= 0) return;
+
+    for (int i = 0; i < height; i++) {
+        fb_fill((y + i) * draw_w + x, width, pixels[i]);
+    }
+}
+
+// =================== RENDER TEXTURES ===================
+// Surfaces are carved out of one block of internal RAM, first fit, rows
+// rounded up to an even number of pixels so every surface starts 32-bit
+// aligned. Slot k holds the surface with id k + 1.
+
+typedef struct {
+    uint16_t *pixels; // NULL for a free slot
+    int width, height;
+    size_t offset, size; // in pixels, within the pool
+} Surface;
+
+static uint16_t *surface_pool = NULL;
+static Surface surfaces[RENDER_TEXTURE_MAX];
+
+RenderTexture2D LoadRenderTexture(int width, int height) {
+    RenderTexture2D target = {0};
+    if (width <= 0 || height <= 0) return target;
+    if (!surface_pool) {
+        surface_pool = heap_caps_malloc(RENDER_TEXTURE_POOL, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (!surface_pool) return target;
+    }
+    size_t size = (size_t)((width + 1) & ~1) * height;
+    // lowest gap between the surfaces in use that fits
+    size_t offset = 0;
+    int slot = -1;
+    for (bool moved = true; moved;) {
+        moved = false;
+        for (int k = 0; k < RENDER_TEXTURE_MAX; k++) {
+            const Surface *s = &surfaces[k];
+            if (s->pixels && offset < s->offset + s->size && s->offset < offset + size) {
+                offset = s->offset + s->size;
+                moved = true;
+            }
+        }
+    }
+    for (int k = 0; k < RENDER_TEXTURE_MAX && slot < 0; k++) {
+        if (!surfaces[k].pixels) slot = k;
+    }
+    if (slot < 0 || (offset + size) * 2 > RENDER_TEXTURE_POOL) return target;
+
+    surfaces[slot] = (Surface){surface_pool + offset, width, height, offset, size};
+    target.id = slot + 1;
+    target.texture = (Texture){.id = slot + 1, .width = width, .height = height, .mipmaps = 1};
+    return target;
+}
+
+void UnloadRenderTexture(RenderTexture2D target) {
+    if (target.id == 0 || target.id > RENDER_TEXTURE_MAX) return;
+    surfaces[target.id - 1].pixels = NULL;
+}
+
+void BeginTextureMode(RenderTexture2D target) {
+    if (target.id == 0 || target.id > RENDER_TEXTURE_MAX || !surfaces[target.id - 1].pixels) return;
+    const Surface *s = &surfaces[target.id - 1];
+    draw_target = s->pixels;
+    draw_w = (s->width + 1) & ~1;
+    draw_h = s->height;
+}
+
+void EndTextureMode(void) {
+    draw_target = framebuffer;
+    draw_w = LCD_W;
+    draw_h = FB_H;
+}
+
+// Copies source out of a render texture to position, skipping pixels equal
+// to key when keyed. raylib keeps render textures bottom-up and flips them
+// back with a negative source height, the shim keeps them top-down and reads
+// them bottom-up for a positive one, so the same call works on both.
+static void texture_blit(Texture2D texture, Rectangle source, Vector2 position, bool keyed, Color key) {
+    if (texture.id == 0 || texture.id > RENDER_TEXTURE_MAX || !surfaces[texture.id - 1].pixels) return;
+    const Surface *s = &surfaces[texture.id - 1];
+    int stride = (s->width + 1) & ~1;
+    bool flip = source.height > 0;
+    int sx = source.x, sy = source.y;
+    int w = source.width, h = flip ? source.height : -source.height;
+    int dx = position.x, dy = position.y;
+
+    // clip the source to the surface, then the destination to the target.
+    // Flipped, the first source rows land on the last destination rows.
+    if (sx < 0) {
+        w += sx;
+        dx -= sx;
+        sx = 0;
+    }
+    if (sy < 0) {
+        h += sy;
+        if (!flip) dy -= sy;
+        sy = 0;
+    }
+    if (sx + w > s->width) w = s->width - sx;
+    if (sy + h > s->height) {
+        if (flip) dy += sy + h - s->height;
+        h = s->height - sy;
+    }
+    if (dx < 0) {
+        w += dx;
+        sx -= dx;
+        dx = 0;
+    }
+    if (dy < 0) {
+        h += dy;
+        if (!flip) sy -= dy;
+        dy = 0;
+    }
+    if (dx + w > draw_w) w = draw_w - dx;
+    if (dy + h > draw_h) {
+        if (flip) sy += dy + h - draw_h;
+        h = draw_h - dy;
+    }
+    if (w <= 0 || h <= 0) return;
+
+    uint16_t k = ColorToInt(key);
+    for (int y = 0; y < h; y++) {
+        const uint16_t *src = &s->pixels[(flip ? sy + h - 1 - y : sy + y) * stride + sx];
+        int d = (dy + y) * draw_w + dx;
+        if (keyed) {
+            for (int x = 0; x < w; x++) {
+                if (src[x] != k) fb_put(d + x, src[x]);
+            }
+            continue;
+        }
+        // rows on the same 32-bit phase copy two pixels per load and store
+        int x = 0;
+        if ((((uintptr_t)src >> 1) & 1) == (d & 1)) {
+            if (d & 1) {
+                fb_put(d, src[0]);
+                x = 1;
+            }
+            const uint32_t *s32 = (const uint32_t *)(src + x);
+            uint32_t *d32 = (uint32_t *)&draw_target[d + x];
+            int words = (w - x) / 2;
+            for (int i = 0; i < words; i++) d32[i] = s32[i];
+            SHIM_COST_ADD(pixels, words * 2);
+            x += words * 2;
+        }
+        for (; x < w; x++) fb_put(d + x, src[x]);
+    }
+}
+
+void DrawTextureRec(Texture2D texture, Rectangle source, Vector2 position, Color tint) {
+    (void)tint;
+    texture_blit(texture, source, position, false, BLANK);
+}
+
+void DrawTexture(Texture2D texture, int posX, int posY, Color tint) {
+    DrawTextureRec(texture, (Rectangle){0, 0, texture.width, texture.height}, (Vector2){posX, posY}, tint);
+}
+
+// Not in raylib: DrawTextureRec leaving the pixels still equal to key, the
+// color the texture was cleared to, see BLANK.
+void DrawTextureKeyed(Texture2D texture, Rectangle source, Vector2 position, Color key) {
+    texture_blit(texture, source, position, true, key);
+}
+
+// =================== TEXT ===================
+// No default font here: text is drawn with the BitmapFont given to
+// SetTextFont, scaled by a whole factor, fontSize / font height.
+void SetTextFont(const BitmapFont *font) {
+    text_font = font;
+}
+
+static int text_scale(int fontSize) {
+    int scale = fontSize / text_font->h;
+    return scale < 1 ? 1 : scale;
+}
+
+int MeasureText(const char *text, int fontSize) {
+    if (!text_font) return 0;
+    return (int)strlen(text) * text_font->w * text_scale(fontSize);
+}
+
+// every run of lit rows in a glyph column is one rectangle
+void DrawText(const char *text, int posX, int posY, int fontSize, Color color) {
+    if (!text_font) return;
+    const BitmapFont *font = text_font;
+    int scale = text_scale(fontSize);
+    for (const char *c = text; *c; c++, posX += font->w * scale) {
+        int glyph = (unsigned char)*c - font->first;
+        if (glyph < 0 || glyph >= font->count) continue;
+        if (posX >= draw_w) break;
+        if (posX + font->w * scale <= 0) continue;
+        const uint16_t *columns = &font->glyphs[glyph * font->w];
+        for (int col = 0; col < font->w; col++) {
+            uint16_t bits = columns[col];
+            for (int row = 0; bits; ) {
+                if (!(bits & 1)) {
+                    bits >>= 1;
+                    row++;
+                    continue;
+                }
+                int first = row;
+                while (bits & 1) {
+                    bits >>= 1;
+                    row++;
+                }
+                DrawRectangle(posX + col * scale, posY + first * scale, scale, (row - first) * scale, color);
+            }
         }
     }
 }
@@ -519,22 +965,143 @@ int WindowShouldClose() {
 
 void SetTargetFPS(unsigned int fps) {
     target_fps = fps;
-    target_frame_time_us = 1000000 / fps;
+    target_frame_time_us = fps > 0 ? 1000000 / fps : 0;
 }
 
 void BeginDrawing() {
     frame_start_time_us = esp_timer_get_time();
 }
 
-void EndDrawing() {
+// framebuffer pixels are byte-swapped RGB565, as the panel expects them
+static inline uint16_t lut_apply(const ColorLut *lut, uint16_t px) {
+    uint16_t v = (px >> 8) | (px << 8);
+    v = lut->r[v >> 11] + lut->g[(v >> 5) & 63] + lut->b[v & 31];
+    return (v >> 8) | (v << 8);
+}
+
+// Sends the columns [x0, x1) of the frame in strips, through the LUT if there
+// is one and repeating every framebuffer row FB_ROW_SCALE times: while one
+// strip is on the bus the next one is built, so neither needs a pass of its
+// own. The framebuffer is read 32 bits at a time, IRAM does not take 16-bit
+// loads, so x0 and x1 are even.
+static void present_strips(const ColorLut *lut, int x0, int x1) {
+    int w = x1 - x0;
+    int strip_lines = LCD_W * PRESENT_STRIP_LINES / w;
+    lcd_set_window(x0, 0, x1 - 1, LCD_H - 1);
+    gpio_set_level(PIN_DC, 1);
+
+    spi_transaction_t t[2];
+    int pending = 0;
+    for (int line = 0, k = 0; line < LCD_H; line += strip_lines, k ^= 1) {
+        int lines = LCD_H - line < strip_lines ? LCD_H - line : strip_lines;
+        if (pending == 2) {
+            spi_transaction_t *done;
+            ESP_ERROR_CHECK(spi_device_get_trans_result(spi, &done, portMAX_DELAY));
+            pending--;
+        }
+        uint32_t *dst = (uint32_t *)present_strip[k];
+        for (int j = 0; j < lines; j++, dst += w / 2) {
+            int row = (line + j) / FB_ROW_SCALE;
+            if (j > 0 && row == (line + j - 1) / FB_ROW_SCALE) {
+                memcpy(dst, dst - w / 2, w * 2);
+                continue;
+            }
+            const uint32_t *src = (const uint32_t *)&framebuffer[row * LCD_W + x0];
+            if (!lut) {
+                for (int i = 0; i < w / 2; i++) dst[i] = src[i];
+                continue;
+            }
+            for (int i = 0; i < w / 2; i++) {
+                uint32_t pair = src[i];
+                dst[i] = lut_apply(lut, pair & 0xFFFF) | (uint32_t)lut_apply(lut, pair >> 16) << 16;
+            }
+        }
+        t[k] = (spi_transaction_t){0};
+        t[k].length = lines * w * 16;
+        t[k].tx_buffer = present_strip[k];
+        ESP_ERROR_CHECK(spi_device_queue_trans(spi, &t[k], portMAX_DELAY));
+        SHIM_COST_ADD(spi_bytes, lines * w * 2);
+        pending++;
+    }
+    while (pending--) {
+        spi_transaction_t *done;
+        ESP_ERROR_CHECK(spi_device_get_trans_result(spi, &done, portMAX_DELAY));
+    }
+}
+
+// Color transform for the frames presented from now on, NULL to send them
+// as drawn. Can change every frame.
+void SetColorLut(const ColorLut *lut) {
+    present_lut = lut;
+}
+
+// Restricts what the next EndDrawing sends to the columns given here, called
+// once per changed span: the frame sends their union. Frames without any call
+// are sent whole.
+void PresentColumns(int x, int width) {
+    // spans are sent 32 bits at a time, widen to even bounds
+    int x1 = (x + width + 1) & ~1;
+    x &= ~1;
+    if (x < 0) x = 0;
+    if (x1 > LCD_W) x1 = LCD_W;
+    for (int i = x; i < x1; i++) present_dirty[i] = 1;
+    present_partial = true;
+}
+
+// Moves the first rows of the framebuffer dx pixels sideways, dx even. What
+// is uncovered on the other side keeps its old content.
+void ScrollFrame(int dx, int rows) {
+    int words = dx / 2;
+    int n = LCD_W / 2 - abs(words);
+    if (words == 0 || n <= 0) return;
+    if (rows > FB_H) rows = FB_H;
+    for (int y = 0; y < rows; y++) {
+        uint32_t *row = (uint32_t *)&framebuffer[y * LCD_W];
+        if (words > 0) {
+            for (int i = n - 1; i >= 0; i--) row[i + words] = row[i];
+        } else {
+            for (int i = 0; i < n; i++) row[i] = row[i - words];
+        }
+    }
+}
+
+static void present_frame(const ColorLut *lut) {
+    if (lut || FB_ROW_SCALE > 1) {
+        present_strips(lut, 0, LCD_W);
+        return;
+    }
     lcd_set_window(0, 0, LCD_W - 1, LCD_H - 1);
     gpio_set_level(PIN_DC, 1);
-    
     spi_transaction_t t = {0};
     t.length = SCREEN_BUFFER_SIZE * 8;
     t.tx_buffer = ((uint8_t*)framebuffer);
-    
     ESP_ERROR_CHECK(spi_device_transmit(spi, &t));
+    SHIM_COST_ADD(spi_bytes, SCREEN_BUFFER_SIZE);
+}
+
+void EndDrawing() {
+    if (!present_partial) {
+        present_frame(present_lut);
+    }
+    // one window per run of dirty columns
+    for (int x = 0; present_partial && x < LCD_W;) {
+        if (!present_dirty[x]) {
+            x++;
+            continue;
+        }
+        int x1 = x;
+        while (x1 < LCD_W && present_dirty[x1]) x1++;
+        if (x == 0 && x1 == LCD_W) {
+            present_frame(present_lut);
+        } else {
+            present_strips(present_lut, x, x1);
+        }
+        x = x1;
+    }
+    if (present_partial) {
+        memset(present_dirty, 0, sizeof(present_dirty));
+        present_partial = false;
+    }
     
     if (target_fps > 0) {
         int64_t frame_end_time_us = esp_timer_get_time();
@@ -542,7 +1109,11 @@ void EndDrawing() {
         int64_t sleep_time_us = target_frame_time_us - frame_elapsed_us;
         
         if (sleep_time_us > 0) {
+            #ifdef COST_COUNTERS
+            uint32_t sleep_start = esp_cpu_get_cycle_count();
+            #endif
             vTaskDelay(pdMS_TO_TICKS(sleep_time_us / 1000));
+            SHIM_COST_ADD(idle_cycles, esp_cpu_get_cycle_count() - sleep_start);
         }
     }
 }
@@ -561,6 +1132,10 @@ float GetFrameTime(void){
     return (float)delta_us / 1000000.0f;
 }
 
+double GetTime(void) {
+    return (double)esp_timer_get_time() / 1000000.0;
+}
+
 int IsKeyDown(KeyboardKey key) {
     if (key == KEY_W) {
         return !gpio_get_level(PIN_KEY_D) && !gpio_get_level(PIN_KEY_A);
@@ -609,9 +1184,6 @@ Color ColorBrightness(Color color, float factor) {
 // =================== UNUSED STUBS ===================
 #define FLAG_MSAA_4X_HINT 0
 void SetConfigFlags(int flags) {}
-void DrawRectangleLines(int x, int y, int width, int height, Color color) {}
-void DrawLine(int startX, int startY, int endX, int endY, Color color) {}
-void DrawCircleV(Vector2 center, float radius, Color color) {}
-void DrawLineEx(Vector2 startPos, Vector2 endPos, float thick, Color color) {}
+
 
 #endif // _RAYLIB_H_
\ No newline at end of file
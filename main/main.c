@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include "raylib.h"
 #define RAYMATH_STATIC_INLINE
@@ -14,12 +16,33 @@
     #define TARGET_FPS 30
     #define SCREEN_W LCD_W
     #define SCREEN_H LCD_H
+    #define FRAME_ROWS FB_H // framebuffer rows, line-doubled on present
     #define RAY_RES 4
+    #define RAY_RES_Y FB_ROW_SCALE // the shim line-doubles on present
 #else
     #define TARGET_FPS 60
     #define SCREEN_W 800
     #define SCREEN_H 600
+    #define FRAME_ROWS SCREEN_H
     #define RAY_RES 1
+    #ifndef RAY_RES_Y
+    #define RAY_RES_Y 1
+    #endif
+#endif
+#define RENDER_H ((SCREEN_H + RAY_RES_Y - 1) / RAY_RES_Y) // rows of the 3D view that get rendered
+#ifdef ESP32
+static_assert(RENDER_H == FB_H, "the 3D view must fill the framebuffer rows");
+#endif
+
+// 3D view rectangles are in rendered rows. The ESP32 framebuffer stores them
+// as they are, on the host they are stretched back to screen rows.
+#ifdef ESP32
+    #define DrawViewRectangle(x, y, w, h, color) DrawRectangle(x, y, w, h, color)
+#else
+    #define DrawViewRectangle(x, y, w, h, color) \
+        (COST_RECT(x, (y) * RAY_RES_Y, w, (h) * RAY_RES_Y), DrawRectangle(x, (y) * RAY_RES_Y, w, (h) * RAY_RES_Y, color))
+    // the shim's colorkey blit: host textures cleared to BLANK are transparent already
+    #define DrawTextureKeyed(texture, source, position, key) DrawTextureRec(texture, source, position, WHITE)
 #endif
 #define COLS 10
 #define ROWS 10
@@ -29,9 +52,62 @@
 #define MAX_RENDER_DIST 20.0
 #define TEXTURE_SIZE 64
 #define THRESHOLD 0.0001
+#define EYE_HEIGHT 0.5
+#define WALL_HEIGHT_UNIT 8 // map_height and map_floor steps per map unit
 
 #define PLAYER_ROTATION_SPEED 1.25
 #define PLAYER_SPEED 2.5
+#define PLAYER_RADIUS 0.2
+
+// fixed simulation rate, rendering interpolates between the last two ticks
+#define SIM_HZ 60
+#define SIM_DT (1.0f / SIM_HZ)
+#define SIM_MAX_STEPS 5 // drop time after a long stall instead of spiraling
+
+#ifdef ESP32
+    #define MAX_ENTITIES 256
+    #define MAX_DRAWN_SPRITES 32 // nearest visible entities drawn per frame
+#else
+    #define MAX_ENTITIES 16384
+    #define MAX_DRAWN_SPRITES 256
+#endif
+#define ENTITY_RADIUS 0.25
+#define ENTITY_SIZE 0.5 // billboard height and width in map units
+#define ENEMY_SPEED 1.5
+#define ENEMY_STOP_DIST 0.6
+
+#ifdef ESP32
+    #define MAX_MASKED_HITS 2
+#else
+    #define MAX_MASKED_HITS 4
+#endif
+
+#define MAX_DOORS 16
+#define DOOR_SPEED 1.5        // opening fraction per second
+#define DOOR_HOLD 3.0         // seconds a door stays open
+#define DOOR_TRIGGER_DIST 1.5 // player distance that opens a door
+#define DOOR_PASSABLE 230     // map_lo from which an open door lets things through
+
+#define MAX_PUSHWALLS 4
+#define PUSHWALL_SPEED 1.0 // cells per second
+#define PUSHWALL_CELLS 2   // how far a pushwall slides
+
+// Light is stored as a level in [0, LIGHT_LEVELS). Wall faces keep it in the
+// upper 6 bits of a byte, the low 2 flag the face ends darkened by a corner.
+#define LIGHT_LEVELS 64
+#define LIGHT_AMBIENT 16
+#define LIGHT_AO_WIDTH 0.35   // face fraction darkened next to a corner
+#define LIGHT_AO_DEPTH 0.5    // level kept right in the corner
+#define SHADE_DIST_SCALE 8    // shade_lut distance steps per raycast unit
+#define SHADE_DIST_STEPS 128
+#ifdef ESP32
+    #define MAX_DYNAMIC_LIGHTS 4
+    #define MAX_COLUMN_LIGHTS 2
+#else
+    #define MAX_DYNAMIC_LIGHTS 32
+    #define MAX_COLUMN_LIGHTS 4
+#endif
+#define LIGHT_TALL_ROWS (RENDER_H / 2) // slices taller than this get lit at both ends
 
 #define POINT_R 2.5
 #define LINE_THICKNESS 1.5
@@ -41,9 +117,39 @@ typedef struct {
     Vector2 dir;
 } Player;
 
+typedef enum {
+    INPUT_FORWARD = 1 << 0,
+    INPUT_BACK    = 1 << 1,
+    INPUT_LEFT    = 1 << 2,
+    INPUT_RIGHT   = 1 << 3,
+    INPUT_STRAFE_LEFT  = 1 << 4,
+    INPUT_STRAFE_RIGHT = 1 << 5,
+    INPUT_USE     = 1 << 6,
+} InputBits;
+
 // 0 null, 1-127 texture_id, 128-255 color_id
 static uint8_t map[ROWS][COLS] = {0};
 
+// wall height above its base in 1/WALL_HEIGHT_UNIT, 0 means one full unit
+static uint8_t map_height[ROWS][COLS] = {0};
+// elevation of the cell floor, the wall stands on a solid plinth this tall
+static uint8_t map_floor[ROWS][COLS] = {0};
+// highest wall top in the map, bounds how far rays continue past short walls
+static float map_max_top = 1.0;
+
+typedef enum {
+    CELL_DOOR     = 1 << 0, // thin panel through the cell center, solid over [lo, hi] along its axis
+    CELL_PARTIAL  = 1 << 1, // box solid over [lo, hi] along its axis only (sliding pushwall)
+    CELL_ALONG_Y  = 1 << 2, // lo/hi are measured along y instead of x
+    CELL_PUSHABLE = 1 << 3, // secret wall the player can push
+} CellFlags;
+
+// Cells that are not a full block. The extent is in 1/255 of a cell and is
+// tested inside the ray walk, so doors and pushwalls need no extra geometry.
+static uint8_t map_flags[ROWS][COLS] = {0};
+static uint8_t map_lo[ROWS][COLS] = {0};
+static uint8_t map_hi[ROWS][COLS] = {0};
+
 // pixel_t assets_map from assets.h
 
 Color color_map[] = {
@@ -56,21 +162,19 @@ Color color_map[] = {
     WHITE    // 134
 };
 
-void init_game() {
-    map[1][3] = tx_bricks;
-    map[1][4] = 131;
-    map[1][5] = 129;
-    map[2][5] = 133;
-    map[3][4] = 129;
-    map[3][5] = tx_bricks;
-
-    map[7][7] = 130;
-    map[8][8] = 129;
-    map[9][9] = 134;
+// textures with an opaque run table (assets_mask) are see-through walls
+bool cell_masked(uint8_t map_cell) {
+    return map_cell < 128 && assets_mask[map_cell] != NULL;
 }
 
-void draw_minimap() {
-    DrawRectangle(0, 0, COLS * MINIMAP_CELL_SCALE, ROWS * MINIMAP_CELL_SCALE, GetColor(0x00000046));
+// The grid and the cells only change with map edits: they are drawn into a
+// layer once per edit (map_set marks it stale) and the layer is composited
+// every frame. Without room for the layer they are drawn every frame.
+#define MINIMAP_BACKGROUND GetColor(0x00000046)
+
+static bool minimap_stale = true;
+
+static void draw_minimap_cells() {
     DrawRectangleLines(0, 0, COLS * MINIMAP_CELL_SCALE, ROWS * MINIMAP_CELL_SCALE, RAYWHITE);
     for (int i = 1; i < COLS; i++) {
         int x = i * MINIMAP_CELL_SCALE;
@@ -99,130 +203,2860 @@ void draw_minimap() {
     }
 }
 
+void draw_minimap() {
+    int w = COLS * MINIMAP_CELL_SCALE, h = ROWS * MINIMAP_CELL_SCALE;
+    if (w > SCREEN_W) w = SCREEN_W;
+    if (h > FRAME_ROWS) h = FRAME_ROWS;
+    static RenderTexture2D layer;
+    static bool layer_tried = false;
+    if (!layer_tried) {
+        layer = LoadRenderTexture(w, h);
+        layer_tried = true;
+    }
+    if (layer.id == 0) {
+        DrawRectangle(0, 0, w, h, MINIMAP_BACKGROUND);
+        draw_minimap_cells();
+        return;
+    }
+    if (minimap_stale) {
+        BeginTextureMode(layer);
+        ClearBackground(MINIMAP_BACKGROUND);
+        draw_minimap_cells();
+        EndTextureMode();
+        minimap_stale = false;
+    }
+    // render textures are stored bottom-up
+    DrawTextureRec(layer.texture, (Rectangle){0, 0, w, -h}, (Vector2){0, 0}, WHITE);
+}
+
 void draw_minimap_player(Vector2 p) {
     DrawCircleV(Vector2Scale(p, MINIMAP_CELL_SCALE), POINT_R * 2.0, GREEN);
 }
 
-void raycast_walls(Player p, Vector2 dir, int slice_x) {
+// =================== COST COUNTERS ===================
+// With COST_COUNTERS, the work behind a frame is counted as it is done: rays
+// and the grid cells they step through, texels read and the distinct cache
+// lines they come from, and on the ESP32 what the shim draws and sends. Time
+// is in ticks: CPU cycles from CCOUNT on the ESP32, the TSC on x86 hosts,
+// nanoseconds elsewhere. Each frame goes into a ring of the last COST_RING,
+// printed every time it fills up. Without the flag every counter compiles
+// to nothing.
+#if defined(COST_HEATMAP) && !defined(COST_COUNTERS)
+    #undef COST_HEATMAP // an option of COST_COUNTERS
+#endif
+
+#ifdef COST_COUNTERS
+#define COST_RING 64
+#define COST_CELL_BUCKETS 32 // rays by cells stepped, the last bucket for longer walks
+#ifdef ESP32
+    #include "esp_cpu.h"
+    #define COST_LINE_BYTES 32
+    #define COST_LINE_SLOTS 2048
+    static inline uint32_t cost_now() { return esp_cpu_get_cycle_count(); }
+#elif defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define COST_LINE_BYTES 64
+    #define COST_LINE_SLOTS 8192
+    static inline uint32_t cost_now() { return (uint32_t)__rdtsc(); }
+#else
+    #include <time.h>
+    #define COST_LINE_BYTES 64
+    #define COST_LINE_SLOTS 8192
+    static inline uint32_t cost_now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+    }
+#endif
+
+// Ticks wrap at 32 bits, differences stay right for anything under a
+// second. Counts are 64-bit so the same struct holds sums over a run.
+typedef struct {
+    uint64_t frame_ticks; // BeginDrawing through the present, without the frame limiter
+    uint64_t cast_ticks;  // inside raycast_walls, drawing the walls included
+    uint64_t rays;        // columns cast by raycast_walls
+    uint64_t cells;       // grid cells stepped by ray_next
+    uint64_t texels;      // wall and sky texels read
+    uint64_t lines;       // distinct cache lines those texels come from
+    uint64_t rects;       // DrawRectangle calls
+    uint64_t pixels;      // pixels written
+    uint64_t spi_bytes;
+} CostFrame;
+
+static CostFrame cost;                  // frame being counted
+static CostFrame cost_ring[COST_RING];
+static uint32_t cost_frames = 0;        // frames pushed into the ring
+static CostFrame cost_total;            // every frame since the start
+static uint32_t cost_frame_start;
+static uint32_t cost_frame_drawn_at;
+static uint32_t cost_cell_hist[COST_CELL_BUCKETS];
+static uint64_t cost_probe_cells;       // stepped by the probe of the next column cast
+static uint32_t cost_line_set[COST_LINE_SLOTS]; // line number + 1, open addressing
+
+#define COST_ADD(field, n) (cost.field += (n))
+#define COST_TEXEL(ptr) cost_texel(ptr)
+
+// counts a texel read and, the first time this frame, its cache line
+static void cost_texel(const void *ptr) {
+    cost.texels++;
+    if (cost.lines >= COST_LINE_SLOTS * 3 / 4) return; // saturated, keep probing short
+    uint32_t line = (uint32_t)((uintptr_t)ptr / COST_LINE_BYTES) + 1;
+    uint32_t slot = (line * 2654435761u) % COST_LINE_SLOTS;
+    while (cost_line_set[slot]) {
+        if (cost_line_set[slot] == line) return;
+        slot = (slot + 1) % COST_LINE_SLOTS;
+    }
+    cost_line_set[slot] = line;
+    cost.lines++;
+}
+
+#ifndef ESP32
+// raylib draws uncounted, the host counts the 3D view rectangles, clipped
+static void cost_rect(int x, int y, int w, int h) {
+    cost.rects++;
+    int x1 = x + w < SCREEN_W ? x + w : SCREEN_W, y1 = y + h < SCREEN_H ? y + h : SCREEN_H;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x1 > x && y1 > y) cost.pixels += (x1 - x) * (y1 - y);
+}
+#define COST_RECT(x, y, w, h) cost_rect(x, y, w, h)
+#endif
+
+static void cost_ray(uint64_t cells) {
+    cost.rays++;
+    cost_cell_hist[cells < COST_CELL_BUCKETS ? cells : COST_CELL_BUCKETS - 1]++;
+}
+
+void cost_frame_begin() {
+    memset(&cost, 0, sizeof(cost));
+    memset(cost_line_set, 0, sizeof(cost_line_set));
+    #ifdef ESP32
+    memset(&shim_cost, 0, sizeof(shim_cost));
+    #endif
+    cost_frame_start = cost_now();
+}
+
+// right before EndDrawing: raylib swaps and waits for the frame rate in it
+void cost_frame_drawn() {
+    cost_frame_drawn_at = cost_now();
+}
+
+static void cost_print(const char *label, const CostFrame *sum, uint32_t frames) {
+    printf("cost %s, per frame: %.0f ticks (%.0f casting), %.1f rays, %.1f cells, "
+           "%.0f texels on %.0f lines, %.0f rects, %.0f pixels, %.0f SPI bytes\n",
+        label, (double)sum->frame_ticks / frames, (double)sum->cast_ticks / frames,
+        (double)sum->rays / frames, (double)sum->cells / frames,
+        (double)sum->texels / frames, (double)sum->lines / frames,
+        (double)sum->rects / frames, (double)sum->pixels / frames, (double)sum->spi_bytes / frames);
+}
+
+static void cost_sum(CostFrame *sum, const CostFrame *f) {
+    sum->frame_ticks += f->frame_ticks;
+    sum->cast_ticks += f->cast_ticks;
+    sum->rays += f->rays;
+    sum->cells += f->cells;
+    sum->texels += f->texels;
+    sum->lines += f->lines;
+    sum->rects += f->rects;
+    sum->pixels += f->pixels;
+    sum->spi_bytes += f->spi_bytes;
+}
+
+void cost_frame_end() {
+    #ifdef ESP32
+    // the shim's present is work, its sleep is not
+    cost.frame_ticks = (uint32_t)(cost_now() - cost_frame_start - shim_cost.idle_cycles);
+    #else
+    cost.frame_ticks = (uint32_t)(cost_frame_drawn_at - cost_frame_start);
+    #endif
+    #ifdef ESP32
+    cost.rects = shim_cost.rects;
+    cost.pixels = shim_cost.pixels;
+    cost.spi_bytes = shim_cost.spi_bytes;
+    #endif
+    cost_ring[cost_frames++ % COST_RING] = cost;
+    cost_sum(&cost_total, &cost);
+    #ifndef BENCHMARK
+    if (cost_frames % COST_RING == 0) {
+        CostFrame sum = {0};
+        for (int i = 0; i < COST_RING; i++) cost_sum(&sum, &cost_ring[i]);
+        cost_print("of the last frames", &sum, COST_RING);
+    }
+    #endif
+}
+
+// the whole run, then rays by cells stepped as a share of all rays
+void cost_report() {
+    if (cost_frames == 0) return;
+    cost_print("over the run", &cost_total, cost_frames);
+    uint32_t rays = 0;
+    for (int i = 0; i < COST_CELL_BUCKETS; i++) rays += cost_cell_hist[i];
+    if (rays == 0) return;
+    printf("cost: cells stepped per ray:");
+    for (int i = 0; i < COST_CELL_BUCKETS; i++) {
+        printf(" %d%s:%.1f%%", i, i == COST_CELL_BUCKETS - 1 ? "+" : "", cost_cell_hist[i] * 100.0 / rays);
+    }
+    printf("\n");
+}
+#else
+#define COST_ADD(field, n) ((void)0)
+#define COST_TEXEL(ptr) ((void)0)
+#define COST_RECT(x, y, w, h) ((void)0)
+#endif
+
+// =================== TRACE ===================
+// With TRACE, the host records zones (a name, start and duration, and the
+// frame they belong to) and writes them on exit to TRACE_FILE as Chrome
+// trace events, for chrome://tracing or Perfetto. Every thread fills its own
+// buffer, which joins a lock-free list on its first event, so recording is a
+// clock read and a store. Events past TRACE_EVENTS per thread are dropped and
+// counted. The ESP32 has nowhere to write the file and ignores the flag.
+#if defined(TRACE) && defined(ESP32)
+    #undef TRACE
+#endif
+
+#ifdef TRACE
+#include <stdatomic.h>
+#include <time.h>
+#ifndef TRACE_FILE
+#define TRACE_FILE "trace.json"
+#endif
+#define TRACE_EVENTS (1 << 16)
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint32_t dur_ns;
+    uint32_t frame;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int tid;
+    uint32_t count;
+    uint32_t dropped;
+    TraceEvent events[TRACE_EVENTS];
+} TraceBuffer;
+
+static _Atomic(TraceBuffer *) trace_buffers = NULL; // every thread's, newest first
+static atomic_int trace_threads = 0;
+static atomic_uint trace_frame = 0;
+static _Thread_local TraceBuffer *trace_local = NULL;
+
+static inline uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static TraceBuffer *trace_buffer() {
+    if (trace_local) return trace_local;
+    TraceBuffer *b = calloc(1, sizeof(TraceBuffer));
+    if (!b) return NULL;
+    b->tid = atomic_fetch_add(&trace_threads, 1) + 1;
+    b->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &b->next, b)) {}
+    return trace_local = b;
+}
+
+static void trace_event(const char *name, uint64_t start_ns) {
+    uint64_t end_ns = trace_now();
+    TraceBuffer *b = trace_buffer();
+    if (!b) return;
+    if (b->count == TRACE_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    b->events[b->count++] = (TraceEvent){
+        name, start_ns, (uint32_t)(end_ns - start_ns), atomic_load_explicit(&trace_frame, memory_order_relaxed),
+    };
+}
+
+// once the other threads are done, timestamps in microseconds from the first event
+void trace_write() {
+    FILE *f = fopen(TRACE_FILE, "w");
+    if (!f) return;
+    uint64_t epoch = UINT64_MAX;
+    for (TraceBuffer *b = atomic_load(&trace_buffers); b; b = b->next) {
+        for (uint32_t i = 0; i < b->count; i++) {
+            if (b->events[i].start_ns < epoch) epoch = b->events[i].start_ns;
+        }
+    }
+    uint32_t events = 0, dropped = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (TraceBuffer *b = atomic_load(&trace_buffers); b; b = b->next) {
+        char thread_name[32] = "main"; // the first thread to record
+        if (b->tid > 1) snprintf(thread_name, sizeof(thread_name), "thread %d", b->tid);
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            b->tid, thread_name);
+        for (uint32_t i = 0; i < b->count; i++) {
+            const TraceEvent *e = &b->events[i];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+                e->name, b->tid, (e->start_ns - epoch) / 1000.0, e->dur_ns / 1000.0, (unsigned)e->frame);
+        }
+        fprintf(f, "%s\n", b->next ? "," : "");
+        events += b->count;
+        dropped += b->dropped;
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+    printf("trace: %u events written to %s, %u dropped\n", (unsigned)events, TRACE_FILE, (unsigned)dropped);
+}
+
+#define TRACE_BEGIN(zone) uint64_t trace_##zone = trace_now()
+#define TRACE_END(zone) trace_event(#zone, trace_##zone)
+#define TRACE_NEXT_FRAME() atomic_fetch_add_explicit(&trace_frame, 1, memory_order_relaxed)
+#else
+#define TRACE_BEGIN(zone)
+#define TRACE_END(zone) ((void)0)
+#define TRACE_NEXT_FRAME() ((void)0)
+#endif
+
+// =================== RAY QUERIES ===================
+// Grid traversal shared by the renderer and gameplay (visibility, hitscan).
+// dir must be normalized, so distances are in map units along the ray.
+
+typedef struct {
+    int cell_x;
+    int cell_y;
+    float dist;    // distance from the origin along the ray
+    int side;      // 0: crossed a vertical (x) boundary, 1: a horizontal (y) one
+    float u;       // horizontal texture coordinate on the hit face, [0, 1)
+    int face;      // FACE_* of the hit cell the ray came in through
+    uint8_t value; // map cell, 0 if nothing was hit
+} RayHit;
+
+// the way a wall face looks
+enum { FACE_WEST, FACE_EAST, FACE_NORTH, FACE_SOUTH };
+
+typedef struct {
+    Vector2 origin;
+    Vector2 dir;
+    float max_dist;
+} RayQuery;
+
+typedef struct {
+    Vector2 origin;
+    Vector2 dir;
+    int cell_x, cell_y;
+    int step_x, step_y;
+    float delta_x, delta_y; // ray length to cross a whole cell on each axis
+    float next_x, next_y;   // ray length to the next x/y boundary
+} RayWalk;
+
+#define RAY_BATCH_CHUNK 256
+#define RAY_ORIGIN_BUCKETS (ROWS * COLS + 1) // last bucket: origins outside the map
+
+void ray_begin(RayWalk *w, Vector2 origin, Vector2 dir) {
     if (dir.x == 0.0) dir.x = THRESHOLD;
     if (dir.y == 0.0) dir.y = THRESHOLD;
-    Vector2 rs = Vector2Add(p.pos, Vector2Scale(dir, THRESHOLD));
-    while (Vector2Length(Vector2Subtract(rs, p.pos)) <= MAX_RENDER_DIST) {
-        Vector2 cell = {.x = floorf(rs.x), .y = floorf(rs.y)};
-        if (rs.x > 0.0 && rs.x < COLS && rs.y > 0.0 && rs.y < ROWS) {
-            uint8_t map_cell = map[(int)cell.y][(int)cell.x];
-            if (map_cell) {
-                // draw slice
-                float dist = Vector2DotProduct(Vector2Subtract(rs, p.pos), p.dir) / ASPECT_RATIO;
-                int h = SCREEN_H / dist;
-                float bright_factor = 1.0 / dist - 0.9;
-                if (bright_factor >= 0.0) bright_factor = 0.0;
-
-                if (map_cell >= 128) {
-                    // color
-                    Color c = ColorBrightness(color_map[map_cell - 128], bright_factor);
-                    DrawRectangle(slice_x, (SCREEN_H - h) / 2.0, RAY_RES, h, c);
-                } else {
-                    const pixel_t *tex = assets_map[map_cell];
-                    int texture_x;
-                    float diff_x = rs.x - cell.x;
-                    float diff_y = rs.y - cell.y;
-
-
-                    if (diff_x > THRESHOLD && diff_x < 1 - THRESHOLD) {
-                        texture_x = diff_x * TEXTURE_SIZE;
-                    } else {
-                        texture_x = TEXTURE_SIZE - (diff_y * TEXTURE_SIZE);
-                    }
-                    int hmax = h;
-                    if(hmax > SCREEN_H) hmax = SCREEN_H;
-
-                    for (int y = 0; y < hmax; y++) {
-                        int overflow_screen = (h-hmax)/2.0;
-                        int texture_y = ((overflow_screen+y) * TEXTURE_SIZE) / h;
-                        pixel_t texel = tex[texture_y * TEXTURE_SIZE + texture_x];
-                        Color texel_color = GetColor(texel);
-                        Color c = ColorBrightness(texel_color, bright_factor);
-                        DrawRectangle(slice_x, (SCREEN_H - hmax) / 2.0 + y, RAY_RES, 1, c);
-                    }
-                }
-                return;
+    w->origin = origin;
+    w->dir = dir;
+    w->cell_x = floorf(origin.x);
+    w->cell_y = floorf(origin.y);
+    w->delta_x = fabsf(1.0f / dir.x);
+    w->delta_y = fabsf(1.0f / dir.y);
+    if (dir.x >= 0) {
+        w->step_x = 1;
+        w->next_x = (w->cell_x + 1.0 - origin.x) * w->delta_x;
+    } else {
+        w->step_x = -1;
+        w->next_x = (origin.x - w->cell_x) * w->delta_x;
+    }
+    if (dir.y >= 0) {
+        w->step_y = 1;
+        w->next_y = (w->cell_y + 1.0 - origin.y) * w->delta_y;
+    } else {
+        w->step_y = -1;
+        w->next_y = (origin.y - w->cell_y) * w->delta_y;
+    }
+}
+
+// puts the walk where ray_next left it when it reported hit, to go on behind it
+void ray_seek(RayWalk *w, const RayHit *hit) {
+    w->cell_x = hit->cell_x;
+    w->cell_y = hit->cell_y;
+    w->next_x = (w->cell_x + (w->step_x > 0) - w->origin.x) / w->dir.x;
+    w->next_y = (w->cell_y + (w->step_y > 0) - w->origin.y) / w->dir.y;
+}
+
+// Doors and sliding pushwalls only fill part of their cell. Given the entry
+// distance and side, finds where the ray meets the solid part before leaving
+// the cell, and returns false if it misses it.
+static bool ray_hit_partial(const RayWalk *w, uint8_t flags, float *dist, int *side, float *u) {
+    int cx = w->cell_x, cy = w->cell_y;
+    float lo = map_lo[cy][cx] / 255.0;
+    float hi = map_hi[cy][cx] / 255.0;
+    float exit = w->next_x < w->next_y ? w->next_x : w->next_y;
+    bool along_y = flags & CELL_ALONG_Y;
+    if (flags & CELL_DOOR) {
+        // panel plane across the cell center, perpendicular to its axis
+        float t = along_y ? (cx + 0.5 - w->origin.x) / w->dir.x : (cy + 0.5 - w->origin.y) / w->dir.y;
+        if (t < *dist || t > exit) return false;
+        float f = along_y ? w->origin.y + w->dir.y * t - cy : w->origin.x + w->dir.x * t - cx;
+        if (f < lo || f > hi) return false;
+        *dist = t;
+        *side = along_y ? 0 : 1;
+        *u = f - lo; // the texture slides with the panel
+        return true;
+    }
+    // box solid over [lo, hi] along the axis, the whole cell across it
+    float o = along_y ? w->origin.y - cy : w->origin.x - cx;
+    float d = along_y ? w->dir.y : w->dir.x;
+    float t0 = (lo - o) / d;
+    float t1 = (hi - o) / d;
+    if (t0 > t1) {
+        float t = t0;
+        t0 = t1;
+        t1 = t;
+    }
+    float t = t0 > *dist ? t0 : *dist;
+    if (t >= t1 || t > exit) return false;
+    if (t0 > *dist) *side = along_y ? 1 : 0;
+    *dist = t;
+    Vector2 rs = Vector2Add(w->origin, Vector2Scale(w->dir, t));
+    *u = *side == 1 ? rs.x - cx : 1.0 - (rs.y - cy);
+    if ((*side == 0) == along_y) {
+        // faces along the axis slide with the block, which is one cell long:
+        // its head starts at lo, its tail ends at hi
+        float slide = hi < 1.0 ? hi - 1.0 : lo;
+        *u += *side == 1 ? -slide : slide;
+    }
+    return true;
+}
+
+// steps to the next non-empty map cell closer than max_dist, the origin cell is never reported
+bool ray_next(RayWalk *w, float max_dist, RayHit *hit) {
+    for (;;) {
+        float dist;
+        int side;
+        if (w->next_x < w->next_y) {
+            dist = w->next_x;
+            w->next_x += w->delta_x;
+            w->cell_x += w->step_x;
+            side = 0;
+        } else {
+            dist = w->next_y;
+            w->next_y += w->delta_y;
+            w->cell_y += w->step_y;
+            side = 1;
+        }
+        COST_ADD(cells, 1);
+        if (dist > max_dist) return false;
+        if (w->cell_x < 0 || w->cell_x >= COLS || w->cell_y < 0 || w->cell_y >= ROWS) continue;
+        uint8_t map_cell = map[w->cell_y][w->cell_x];
+        if (map_cell) {
+            float u;
+            uint8_t flags = map_flags[w->cell_y][w->cell_x];
+            if (flags & (CELL_DOOR | CELL_PARTIAL)) {
+                if (!ray_hit_partial(w, flags, &dist, &side, &u) || dist > max_dist) continue;
+            } else {
+                Vector2 rs = Vector2Add(w->origin, Vector2Scale(w->dir, dist));
+                u = side == 1 ? rs.x - w->cell_x : 1.0 - (rs.y - w->cell_y);
+            }
+            hit->cell_x = w->cell_x;
+            hit->cell_y = w->cell_y;
+            hit->dist = dist;
+            hit->side = side;
+            hit->u = u;
+            if (side == 0) {
+                hit->face = w->step_x > 0 ? FACE_WEST : FACE_EAST;
+            } else {
+                hit->face = w->step_y > 0 ? FACE_NORTH : FACE_SOUTH;
             }
+            hit->value = map_cell;
+            return true;
         }
-        float distX = cell.x + (dir.x >= 0 ? 1.0 : -THRESHOLD) - rs.x;
-        float distY = cell.y + (dir.y >= 0 ? 1.0 : -THRESHOLD) - rs.y;
-        Vector2 inc;
-        if (fabs(distX / dir.x) < fabs(distY / dir.y)) {
-            inc = (Vector2){.x = distX, .y = distX * dir.y / dir.x};
-        } else {
-            inc = (Vector2){.x = distY * dir.x / dir.y, .y = distY};
+    }
+}
+
+bool ray_query(Vector2 origin, Vector2 dir, float max_dist, RayHit *hit) {
+    RayWalk w;
+    ray_begin(&w, origin, dir);
+    if (ray_next(&w, max_dist, hit)) return true;
+    *hit = (RayHit){.cell_x = -1, .cell_y = -1, .dist = max_dist};
+    return false;
+}
+
+bool line_of_sight(Vector2 from, Vector2 to) {
+    Vector2 d = Vector2Subtract(to, from);
+    float len = Vector2Length(d);
+    if (len < THRESHOLD) return true;
+    RayWalk w;
+    RayHit hit;
+    ray_begin(&w, from, Vector2Scale(d, 1.0 / len));
+    while (ray_next(&w, len, &hit)) {
+        if (!cell_masked(hit.value)) return false;
+    }
+    return true;
+}
+
+static int ray_origin_bucket(Vector2 origin) {
+    int cx = floorf(origin.x);
+    int cy = floorf(origin.y);
+    if (cx < 0 || cx >= COLS || cy < 0 || cy >= ROWS) return ROWS * COLS;
+    return cy * COLS + cx;
+}
+
+// Answers count queries into hits (hits[i].value == 0 on a miss). Each chunk
+// is counting-sorted by origin cell first, so queries fired from the same
+// place walk the same map rows back to back.
+void ray_query_batch(const RayQuery *queries, RayHit *hits, int count) {
+    static uint16_t order[RAY_BATCH_CHUNK];
+    static uint16_t bucket_start[RAY_ORIGIN_BUCKETS + 1];
+    for (int base = 0; base < count; base += RAY_BATCH_CHUNK) {
+        int n = count - base;
+        if (n > RAY_BATCH_CHUNK) n = RAY_BATCH_CHUNK;
+
+        memset(bucket_start, 0, sizeof(bucket_start));
+        for (int i = 0; i < n; i++) {
+            bucket_start[ray_origin_bucket(queries[base + i].origin) + 1]++;
         }
-        Vector2 new_rs = Vector2Add(rs, inc);
-        #ifdef DEBUG
-        // draw raycast on minimap
-        if (new_rs.x > -1.0 && new_rs.x <= COLS && new_rs.y > -1.0 && new_rs.y <= ROWS && rs.x > -1.0 && rs.x <= COLS && rs.y > -1.0 && rs.y <= ROWS) {
-            DrawLineEx(Vector2Scale(rs, MINIMAP_CELL_SCALE), Vector2Scale(new_rs, MINIMAP_CELL_SCALE), LINE_THICKNESS, BLUE);
-            // DrawCircleV(Vector2Scale(rs, MINIMAP_CELL_SCALE), POINT_R, RED);
+        for (int b = 0; b < RAY_ORIGIN_BUCKETS; b++) {
+            bucket_start[b + 1] += bucket_start[b];
+        }
+        for (int i = 0; i < n; i++) {
+            order[bucket_start[ray_origin_bucket(queries[base + i].origin)]++] = i;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const RayQuery *q = &queries[base + order[i]];
+            ray_query(q->origin, q->dir, q->max_dist, &hits[base + order[i]]);
         }
-        #endif
-        rs = new_rs;
     }
 }
 
-void move_player(Player *p) {
-    float dt = GetFrameTime();
-    if (IsKeyDown(KEY_A)) {
-        p->dir = Vector2Rotate(p->dir, -dt * PLAYER_ROTATION_SPEED);
+// =================== FLOW FIELD ===================
+// One BFS from the player's cell gives every passable cell a direction
+// towards the player, shared by all agents. Builds are spread over ticks
+// into a back grid; agents keep reading the last finished one.
+
+#define FLOW_CELLS_PER_TICK 24 // cells expanded per simulation tick
+#define FLOW_UNREACHED 0xFFFF
+#define FLOW_NONE -1
+
+// 8 neighbours, orthogonal first so they win distance ties
+static const int8_t flow_dx[8] = {1, 0, -1, 0, 1, -1, -1, 1};
+static const int8_t flow_dy[8] = {0, 1, 0, -1, 1, 1, -1, -1};
+
+typedef struct {
+    uint16_t dist[ROWS * COLS]; // steps to the goal
+    int8_t dir[ROWS * COLS];    // index into flow_dx/flow_dy, FLOW_NONE at the goal or if unreachable
+} FlowGrid;
+
+typedef struct {
+    FlowGrid grids[2];
+    int front; // grid agents read
+    uint16_t queue[ROWS * COLS];
+    int head;
+    int tail;
+    int goal;       // cell index of the build in progress (or last finished), -1 if none
+    bool building;
+    bool ready;     // the front grid holds a finished build
+    bool dirty;     // rebuild even if the goal did not move
+} FlowField;
+
+static FlowField flow;
+
+bool cell_passable(int x, int y) {
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS) return false;
+    if (map_flags[y][x] & CELL_DOOR) return map_lo[y][x] >= DOOR_PASSABLE;
+    return map[y][x] == 0;
+}
+
+void flow_init(FlowField *f) {
+    memset(f, 0, sizeof(*f));
+    memset(f->grids[f->front].dir, FLOW_NONE, sizeof(f->grids[f->front].dir));
+    f->goal = -1;
+    f->dirty = true;
+}
+
+// call after loading a map so the field is rebuilt from the next tick
+void flow_invalidate(FlowField *f) {
+    f->dirty = true;
+}
+
+// direction of cell c towards its closest neighbour, FLOW_NONE at the goal
+// or if unreached
+static int8_t flow_cell_dir(const FlowGrid *g, int c) {
+    int x = c % COLS;
+    int y = c / COLS;
+    if (g->dist[c] == FLOW_UNREACHED) return FLOW_NONE;
+    uint16_t best = g->dist[c];
+    int8_t dir = FLOW_NONE;
+    for (int k = 0; k < 8; k++) {
+        int nx = x + flow_dx[k];
+        int ny = y + flow_dy[k];
+        if (!cell_passable(nx, ny)) continue;
+        // diagonal moves must not cut a wall corner
+        if (k >= 4 && (!cell_passable(nx, y) || !cell_passable(x, ny))) continue;
+        int n = ny * COLS + nx;
+        if (g->dist[n] < best) {
+            best = g->dist[n];
+            dir = k;
+        }
     }
-    if (IsKeyDown(KEY_D)) {
-        p->dir = Vector2Rotate(p->dir, dt * PLAYER_ROTATION_SPEED);
+    return dir;
+}
+
+static void flow_start(FlowField *f, int goal) {
+    FlowGrid *g = &f->grids[!f->front];
+    for (int i = 0; i < ROWS * COLS; i++) {
+        g->dist[i] = FLOW_UNREACHED;
+        g->dir[i] = FLOW_NONE;
     }
-    if (IsKeyDown(KEY_W)) {
-        p->pos = Vector2Add(p->pos, Vector2Scale(p->dir, dt * PLAYER_SPEED));
+    f->goal = goal;
+    f->head = 0;
+    f->tail = 0;
+    f->building = true;
+    f->dirty = false;
+    if (goal < 0) return;
+    g->dist[goal] = 0;
+    f->queue[f->tail++] = goal;
+}
+
+// Restarts the build when the goal cell changes or the field was invalidated, then
+// expands at most FLOW_CELLS_PER_TICK cells. When a cell is popped all its
+// closer neighbours are final, so its direction is settled right away.
+void flow_update(FlowField *f, Vector2 goal_pos) {
+    int gx = floorf(goal_pos.x);
+    int gy = floorf(goal_pos.y);
+    int goal = cell_passable(gx, gy) ? gy * COLS + gx : -1;
+    if (goal != f->goal || f->dirty) flow_start(f, goal);
+    if (!f->building) return;
+
+    FlowGrid *g = &f->grids[!f->front];
+    for (int budget = FLOW_CELLS_PER_TICK; budget > 0 && f->head < f->tail; budget--) {
+        int c = f->queue[f->head++];
+        int x = c % COLS;
+        int y = c / COLS;
+        for (int k = 0; k < 4; k++) {
+            int nx = x + flow_dx[k];
+            int ny = y + flow_dy[k];
+            if (!cell_passable(nx, ny)) continue;
+            int n = ny * COLS + nx;
+            if (g->dist[n] == FLOW_UNREACHED) {
+                g->dist[n] = g->dist[c] + 1;
+                f->queue[f->tail++] = n;
+            }
+        }
+        g->dir[c] = flow_cell_dir(g, c);
+    }
+    if (f->head == f->tail) {
+        f->building = false;
+        f->ready = true;
+        f->front = !f->front;
+    }
+}
+
+// one more than the closest reached orthogonal neighbour, FLOW_UNREACHED if none
+static uint16_t flow_neighbour_dist(const FlowGrid *g, int c) {
+    int best = FLOW_UNREACHED;
+    for (int k = 0; k < 4; k++) {
+        int nx = c % COLS + flow_dx[k];
+        int ny = c / COLS + flow_dy[k];
+        if (!cell_passable(nx, ny)) continue;
+        int d = g->dist[ny * COLS + nx];
+        if (d != FLOW_UNREACHED && d + 1 < best) best = d + 1;
     }
-    if (IsKeyDown(KEY_S)) {
-        p->pos = Vector2Add(p->pos, Vector2Scale(p->dir, -dt * PLAYER_SPEED));
+    return best;
+}
+
+#define FLOW_QUEUED 1
+#define FLOW_CHANGED 2
+
+// Patches a finished grid after cell c flipped passability, visiting only
+// the cells whose distance depends on it. An opened cell takes its distance
+// from its neighbours and shortens the paths behind it. A closed one clears
+// itself and every cell one step further from it, which are then refilled
+// from the cells around them that kept their distance. Directions are
+// settled again around every changed cell.
+static void flow_repair(FlowGrid *g, int c) {
+    static uint16_t queue[ROWS * COLS]; // circular, a cell is in it at most once
+    static uint16_t changed[ROWS * COLS];
+    static uint8_t mark[ROWS * COLS];
+    int head = 0, count = 0, n_changed = 0;
+    changed[n_changed++] = c;
+    mark[c] = FLOW_CHANGED;
+    if (cell_passable(c % COLS, c / COLS)) {
+        g->dist[c] = flow_neighbour_dist(g, c);
+        if (g->dist[c] != FLOW_UNREACHED) {
+            queue[(head + count++) % (ROWS * COLS)] = c;
+            mark[c] |= FLOW_QUEUED;
+        }
+    } else if (g->dist[c] != FLOW_UNREACHED) {
+        for (int i = 0; i < n_changed; i++) {
+            int u = changed[i];
+            for (int k = 0; k < 4; k++) {
+                int nx = u % COLS + flow_dx[k];
+                int ny = u / COLS + flow_dy[k];
+                if (nx < 0 || nx >= COLS || ny < 0 || ny >= ROWS) continue;
+                int n = ny * COLS + nx;
+                if (mark[n] || g->dist[n] != g->dist[u] + 1) continue;
+                mark[n] = FLOW_CHANGED;
+                changed[n_changed++] = n;
+            }
+        }
+        for (int i = 0; i < n_changed; i++) g->dist[changed[i]] = FLOW_UNREACHED;
+        for (int i = 1; i < n_changed; i++) {
+            int u = changed[i];
+            g->dist[u] = flow_neighbour_dist(g, u);
+            if (g->dist[u] == FLOW_UNREACHED) continue;
+            queue[(head + count++) % (ROWS * COLS)] = u;
+            mark[u] |= FLOW_QUEUED;
+        }
     }
-    if (IsKeyDown(KEY_E)) {
-        p->pos = Vector2Add(p->pos, Vector2Scale(Vector2Rotate(p->dir, PI / 2.0), dt * PLAYER_SPEED));
+    // shorter distances spread until nothing improves
+    while (count > 0) {
+        int u = queue[head];
+        head = (head + 1) % (ROWS * COLS);
+        count--;
+        mark[u] &= ~FLOW_QUEUED;
+        for (int k = 0; k < 4; k++) {
+            int nx = u % COLS + flow_dx[k];
+            int ny = u / COLS + flow_dy[k];
+            if (!cell_passable(nx, ny)) continue;
+            int n = ny * COLS + nx;
+            if (g->dist[u] + 1 >= g->dist[n]) continue;
+            g->dist[n] = g->dist[u] + 1;
+            if (!(mark[n] & FLOW_CHANGED)) changed[n_changed++] = n;
+            if (!(mark[n] & FLOW_QUEUED)) queue[(head + count++) % (ROWS * COLS)] = n;
+            mark[n] |= FLOW_CHANGED | FLOW_QUEUED;
+        }
     }
-    if (IsKeyDown(KEY_Q)) {
-        p->pos = Vector2Add(p->pos, Vector2Scale(Vector2Rotate(p->dir, -PI / 2.0), dt * PLAYER_SPEED));
+    for (int i = 0; i < n_changed; i++) {
+        int u = changed[i];
+        for (int k = -1; k < 8; k++) {
+            int nx = u % COLS + (k < 0 ? 0 : flow_dx[k]);
+            int ny = u / COLS + (k < 0 ? 0 : flow_dy[k]);
+            if (nx < 0 || nx >= COLS || ny < 0 || ny >= ROWS) continue;
+            g->dir[ny * COLS + nx] = flow_cell_dir(g, ny * COLS + nx);
+        }
     }
+    for (int i = 0; i < n_changed; i++) mark[changed[i]] = 0;
 }
 
-void draw_walls(Player p) {
-    float alpha = -FOV_ANGLE / 2.0;
-    float alpha_step = FOV_ANGLE * RAY_RES / SCREEN_W;
-    for (int slice_x = 0; slice_x < SCREEN_W; slice_x += RAY_RES) {
-        Vector2 ray = Vector2Rotate(p.dir, alpha);
-        raycast_walls(p, ray, slice_x);
-        alpha += alpha_step;
+// Call after cell (x, y) flipped passability. The grid agents read is
+// patched around the cell. A build in progress that already got next to the
+// cell restarts, otherwise its later expansions see the new map anyway.
+void flow_cell_changed(FlowField *f, int x, int y) {
+    int c = y * COLS + x;
+    if (f->ready) flow_repair(&f->grids[f->front], c);
+    if (!f->building) return;
+    const FlowGrid *g = &f->grids[!f->front];
+    for (int k = -1; k < 4; k++) {
+        int nx = x + (k < 0 ? 0 : flow_dx[k]);
+        int ny = y + (k < 0 ? 0 : flow_dy[k]);
+        if (nx < 0 || nx >= COLS || ny < 0 || ny >= ROWS) continue;
+        if (g->dist[ny * COLS + nx] != FLOW_UNREACHED) f->dirty = true;
     }
 }
 
-#ifdef ESP32
-int app_main()
-#else
-int main()
+// unit vector an agent at pos should move along, zero at the goal or when unreachable
+Vector2 flow_direction(const FlowField *f, Vector2 pos) {
+    int x = floorf(pos.x);
+    int y = floorf(pos.y);
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS) return Vector2Zero();
+    int8_t k = f->grids[f->front].dir[y * COLS + x];
+    if (k == FLOW_NONE) return Vector2Zero();
+    float len = k < 4 ? 1.0 : 1.0 / sqrtf(2.0);
+    return (Vector2){flow_dx[k] * len, flow_dy[k] * len};
+}
+
+#ifdef DEBUG
+void draw_minimap_flow(const FlowField *f) {
+    const FlowGrid *g = &f->grids[f->front];
+    for (int i = 0; i < ROWS * COLS; i++) {
+        if (g->dir[i] == FLOW_NONE) continue;
+        Vector2 c = {(i % COLS + 0.5) * MINIMAP_CELL_SCALE, (i / COLS + 0.5) * MINIMAP_CELL_SCALE};
+        Vector2 d = {flow_dx[g->dir[i]] * MINIMAP_CELL_SCALE * 0.3, flow_dy[g->dir[i]] * MINIMAP_CELL_SCALE * 0.3};
+        DrawLine(c.x, c.y, c.x + d.x, c.y + d.y, DARKGRAY);
+    }
+}
 #endif
-{
-    init_game();
-    InitWindow(SCREEN_W, SCREEN_H, "ray");
-    SetTargetFPS(TARGET_FPS);
-    SetConfigFlags(FLAG_MSAA_4X_HINT);
-    Player p = {.pos = {.x = 0.2, .y = 1.3}, .dir = {.x = 1, .y = 0}};
 
-    while (!WindowShouldClose()) {
-        move_player(&p);
-        BeginDrawing();
-        ClearBackground(BLACK);
-        draw_walls(p);
-        #ifdef DEBUG
-        draw_minimap();
-        draw_minimap_player(p.pos);
-        #endif
-        EndDrawing();
+// =================== COLLISION ===================
+// Moving circles are swept against the map grid as their bounding box, one
+// axis at a time, so a blocked axis stops while the other keeps going (slide).
+// Only the cells under the swept box are visited, which keeps large steps
+// exact without substepping. Cells the box already overlaps are ignored so
+// anything spawned inside a wall can still get out. Outside the map is solid.
+
+#define COLLISION_SKIN 0.001 // gap kept between a box and the wall it stopped at
+
+// allowed motion of the leading edge along one axis; lo/hi is the range of
+// cells the box covers on the other axis
+static float sweep_axis(float edge, float delta, int lo, int hi, bool along_x) {
+    if (delta > 0.0) {
+        int c0 = ceilf(edge);
+        int c1 = (int)ceilf(edge + delta) - 1;
+        for (int c = c0; c <= c1; c++) {
+            for (int k = lo; k <= hi; k++) {
+                if (!(along_x ? cell_passable(c, k) : cell_passable(k, c))) {
+                    float allowed = c - edge - COLLISION_SKIN;
+                    return allowed < delta ? allowed : delta;
+                }
+            }
+        }
+    } else if (delta < 0.0) {
+        int c0 = (int)floorf(edge) - 1;
+        int c1 = floorf(edge + delta);
+        for (int c = c0; c >= c1; c--) {
+            for (int k = lo; k <= hi; k++) {
+                if (!(along_x ? cell_passable(c, k) : cell_passable(k, c))) {
+                    float allowed = c + 1 - edge + COLLISION_SKIN;
+                    return allowed > delta ? allowed : delta;
+                }
+            }
+        }
+    }
+    return delta;
+}
+
+Vector2 collide_move(Vector2 pos, Vector2 delta, float radius) {
+    int y0 = floorf(pos.y - radius);
+    int y1 = (int)ceilf(pos.y + radius) - 1;
+    pos.x += sweep_axis(pos.x + (delta.x > 0.0 ? radius : -radius), delta.x, y0, y1, true);
+    int x0 = floorf(pos.x - radius);
+    int x1 = (int)ceilf(pos.x + radius) - 1;
+    pos.y += sweep_axis(pos.y + (delta.y > 0.0 ? radius : -radius), delta.y, x0, x1, false);
+    return pos;
+}
+
+// same as collide_move over the entity arrays, positions are updated in place
+void collide_move_batch(float *pos_x, float *pos_y, const float *vel_x, const float *vel_y,
+                        float radius, float dt, int count) {
+    for (int i = 0; i < count; i++) {
+        float dx = vel_x[i] * dt;
+        float dy = vel_y[i] * dt;
+        if (dx == 0.0 && dy == 0.0) continue;
+        Vector2 pos = collide_move((Vector2){pos_x[i], pos_y[i]}, (Vector2){dx, dy}, radius);
+        pos_x[i] = pos.x;
+        pos_y[i] = pos.y;
+    }
+}
+
+// =================== ENTITIES ===================
+// Entities are stored as parallel arrays packed in [0, count), removal swaps
+// the last one in. Handles stay valid across swaps through a slot table and
+// go stale when the slot is reused (generation in the high 16 bits).
+
+typedef uint32_t EntityHandle; // 0 is never a valid handle
+
+typedef enum {
+    ENTITY_ENEMY      = 1 << 0,
+    ENTITY_PICKUP     = 1 << 1,
+    ENTITY_PROJECTILE = 1 << 2,
+} EntityFlags;
+
+#define ENTITY_BUCKETS (ROWS * COLS + 1) // last bucket: entities outside the map
+
+typedef struct {
+    int count;
+    float pos_x[MAX_ENTITIES];
+    float pos_y[MAX_ENTITIES];
+    float prev_x[MAX_ENTITIES]; // position at the previous tick, for interpolation
+    float prev_y[MAX_ENTITIES];
+    float vel_x[MAX_ENTITIES];
+    float vel_y[MAX_ENTITIES];
+    uint8_t sprite[MAX_ENTITIES]; // color_map index
+    uint8_t flags[MAX_ENTITIES];
+    uint16_t slot[MAX_ENTITIES];  // dense index -> handle slot
+
+    uint16_t dense[MAX_ENTITIES]; // handle slot -> dense index
+    uint16_t generation[MAX_ENTITIES];
+    uint16_t free_slots[MAX_ENTITIES];
+    int free_count;
+
+    // spatial hash on the map grid, rebuilt every tick by counting sort
+    uint16_t cell_start[ENTITY_BUCKETS + 1];
+    uint16_t cell_items[MAX_ENTITIES];
+} Entities;
+
+static Entities entities;
+
+void entities_init(Entities *e) {
+    e->count = 0;
+    e->free_count = MAX_ENTITIES;
+    for (int i = 0; i < MAX_ENTITIES; i++) {
+        e->free_slots[i] = MAX_ENTITIES - 1 - i;
+        e->generation[i] = 1;
+    }
+    memset(e->cell_start, 0, sizeof(e->cell_start));
+}
+
+EntityHandle entity_spawn(Entities *e, Vector2 pos, uint8_t sprite, uint8_t flags) {
+    if (e->free_count == 0) return 0;
+    uint16_t slot = e->free_slots[--e->free_count];
+    int i = e->count++;
+    e->pos_x[i] = e->prev_x[i] = pos.x;
+    e->pos_y[i] = e->prev_y[i] = pos.y;
+    e->vel_x[i] = 0.0;
+    e->vel_y[i] = 0.0;
+    e->sprite[i] = sprite;
+    e->flags[i] = flags;
+    e->slot[i] = slot;
+    e->dense[slot] = i;
+    return ((EntityHandle)e->generation[slot] << 16) | slot;
+}
+
+// dense index of a live handle, -1 if it was destroyed
+int entity_index(const Entities *e, EntityHandle h) {
+    uint16_t slot = h & 0xFFFF;
+    if (slot >= MAX_ENTITIES || e->generation[slot] != h >> 16) return -1;
+    return e->dense[slot];
+}
+
+void entity_destroy(Entities *e, EntityHandle h) {
+    int i = entity_index(e, h);
+    if (i < 0) return;
+    uint16_t slot = h & 0xFFFF;
+    int last = --e->count;
+    if (i != last) {
+        e->pos_x[i] = e->pos_x[last];
+        e->pos_y[i] = e->pos_y[last];
+        e->prev_x[i] = e->prev_x[last];
+        e->prev_y[i] = e->prev_y[last];
+        e->vel_x[i] = e->vel_x[last];
+        e->vel_y[i] = e->vel_y[last];
+        e->sprite[i] = e->sprite[last];
+        e->flags[i] = e->flags[last];
+        e->slot[i] = e->slot[last];
+        e->dense[e->slot[i]] = i;
+    }
+    if (++e->generation[slot] == 0) e->generation[slot] = 1;
+    e->free_slots[e->free_count++] = slot;
+}
+
+EntityHandle entity_handle(const Entities *e, int i) {
+    uint16_t slot = e->slot[i];
+    return ((EntityHandle)e->generation[slot] << 16) | slot;
+}
+
+static int entity_bucket(float x, float y) {
+    int cx = floorf(x);
+    int cy = floorf(y);
+    if (cx < 0 || cx >= COLS || cy < 0 || cy >= ROWS) return ROWS * COLS;
+    return cy * COLS + cx;
+}
+
+void entities_build_hash(Entities *e) {
+    memset(e->cell_start, 0, sizeof(e->cell_start));
+    for (int i = 0; i < e->count; i++) {
+        e->cell_start[entity_bucket(e->pos_x[i], e->pos_y[i])]++;
+    }
+    for (int b = 1; b < ENTITY_BUCKETS; b++) {
+        e->cell_start[b] += e->cell_start[b - 1];
+    }
+    e->cell_start[ENTITY_BUCKETS] = e->count;
+    // scatter backwards, each bucket end walks down to the bucket start
+    for (int i = e->count - 1; i >= 0; i--) {
+        int b = entity_bucket(e->pos_x[i], e->pos_y[i]);
+        e->cell_items[--e->cell_start[b]] = i;
+    }
+}
+
+// Broad phase: dense indices of entities bucketed in the cells overlapped by
+// the box around pos. Entities outside the map are always candidates. With
+// flags, only entities that have one of them fill out.
+int entities_near(const Entities *e, Vector2 pos, float radius, uint8_t flags, uint16_t *out, int max) {
+    int n = 0;
+    int x0 = floorf(pos.x - radius), x1 = floorf(pos.x + radius);
+    int y0 = floorf(pos.y - radius), y1 = floorf(pos.y + radius);
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= COLS) x1 = COLS - 1;
+    if (y1 >= ROWS) y1 = ROWS - 1;
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int b = y * COLS + x;
+            for (int k = e->cell_start[b]; k < e->cell_start[b + 1] && n < max; k++) {
+                if (flags && !(e->flags[e->cell_items[k]] & flags)) continue;
+                out[n++] = e->cell_items[k];
+            }
+        }
+    }
+    for (int k = e->cell_start[ROWS * COLS]; k < e->cell_start[ENTITY_BUCKETS] && n < max; k++) {
+        if (flags && !(e->flags[e->cell_items[k]] & flags)) continue;
+        out[n++] = e->cell_items[k];
+    }
+    return n;
+}
+
+void entities_update(Entities *e, const FlowField *f, Vector2 player_pos, float dt) {
+    for (int i = 0; i < e->count; i++) {
+        e->prev_x[i] = e->pos_x[i];
+        e->prev_y[i] = e->pos_y[i];
+    }
+    for (int i = 0; i < e->count; i++) {
+        if (!(e->flags[i] & ENTITY_ENEMY)) continue;
+        Vector2 pos = {e->pos_x[i], e->pos_y[i]};
+        Vector2 to_player = Vector2Subtract(player_pos, pos);
+        float player_dist = Vector2Length(to_player);
+        Vector2 dir = Vector2Zero();
+        if (player_dist > ENEMY_STOP_DIST) {
+            dir = flow_direction(f, pos);
+            // sharing the player's cell, head straight for it
+            if (dir.x == 0.0 && dir.y == 0.0) dir = Vector2Scale(to_player, 1.0 / player_dist);
+        }
+        e->vel_x[i] = dir.x * ENEMY_SPEED;
+        e->vel_y[i] = dir.y * ENEMY_SPEED;
+    }
+    collide_move_batch(e->pos_x, e->pos_y, e->vel_x, e->vel_y, ENTITY_RADIUS, dt, e->count);
+    entities_build_hash(e);
+}
+
+// the player picks up whatever pickup it touches, returns how many
+int entities_collect(Entities *e, Vector2 player_pos, float radius) {
+    uint16_t near[32];
+    EntityHandle taken[32];
+    int n_taken = 0;
+    // enemies crowding the player must not take the slots of pickups
+    int n = entities_near(e, player_pos, radius + ENTITY_RADIUS, ENTITY_PICKUP, near, ARRAY_LEN(near));
+    for (int k = 0; k < n; k++) {
+        int i = near[k];
+        Vector2 d = {e->pos_x[i] - player_pos.x, e->pos_y[i] - player_pos.y};
+        if (Vector2Length(d) < radius + ENTITY_RADIUS) taken[n_taken++] = entity_handle(e, i);
+    }
+    // destroy after the scan, swap-remove would shuffle the indices
+    for (int k = 0; k < n_taken; k++) {
+        entity_destroy(e, taken[k]);
+    }
+    return n_taken;
+}
+
+// =================== MAP EDITS ===================
+// Runtime changes to the map go through these calls. They patch what is
+// derived from the map for the edited cell only: the wall top histogram
+// behind map_max_top and, when the cell's passability flips, the flow field
+// around it.
+
+static uint16_t map_top_count[2 * 256]; // walls per top level, in 1/WALL_HEIGHT_UNIT
+
+static int cell_top_level(int x, int y) {
+    return map_floor[y][x] + (map_height[y][x] ? map_height[y][x] : WALL_HEIGHT_UNIT);
+}
+
+float cell_base(int x, int y) {
+    return map_floor[y][x] / (float)WALL_HEIGHT_UNIT;
+}
+
+float cell_top(int x, int y) {
+    return cell_top_level(x, y) / (float)WALL_HEIGHT_UNIT;
+}
+
+static void map_refresh_max_top() {
+    int level = ARRAY_LEN(map_top_count) - 1;
+    while (level > 0 && map_top_count[level] == 0) level--;
+    map_max_top = level / (float)WALL_HEIGHT_UNIT;
+}
+
+// derived state from scratch, once after the level is loaded
+void map_build_derived() {
+    memset(map_top_count, 0, sizeof(map_top_count));
+    for (int y = 0; y < ROWS; y++) {
+        for (int x = 0; x < COLS; x++) {
+            if (map[y][x]) map_top_count[cell_top_level(x, y)]++;
+        }
+    }
+    map_refresh_max_top();
+    flow_invalidate(&flow);
+    minimap_stale = true;
+}
+
+static bool map_edit_begin(int x, int y) {
+    if (map[y][x]) map_top_count[cell_top_level(x, y)]--;
+    return cell_passable(x, y);
+}
+
+static void map_edit_end(int x, int y, bool was_passable) {
+    if (map[y][x]) map_top_count[cell_top_level(x, y)]++;
+    map_refresh_max_top();
+    if (cell_passable(x, y) != was_passable) flow_cell_changed(&flow, x, y);
+}
+
+void map_set(int x, int y, uint8_t value) {
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS || map[y][x] == value) return;
+    bool was_passable = map_edit_begin(x, y);
+    map[y][x] = value;
+    map_edit_end(x, y, was_passable);
+    minimap_stale = true;
+}
+
+void map_set_height(int x, int y, uint8_t height, uint8_t floor) {
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS) return;
+    bool was_passable = map_edit_begin(x, y);
+    map_height[y][x] = height;
+    map_floor[y][x] = floor;
+    map_edit_end(x, y, was_passable);
+}
+
+void map_set_extent(int x, int y, uint8_t flags, uint8_t lo, uint8_t hi) {
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS) return;
+    bool was_passable = map_edit_begin(x, y);
+    map_flags[y][x] = flags;
+    map_lo[y][x] = lo;
+    map_hi[y][x] = hi;
+    map_edit_end(x, y, was_passable);
+}
+
+typedef struct {
+    int x, y;
+    float open; // 0 closed, 1 open
+    float hold; // seconds left before it closes
+} Door;
+
+static Door doors[MAX_DOORS];
+static int door_count = 0;
+
+// along_y: the panel spans the cell along y and slides that way
+void door_add(int x, int y, uint8_t value, bool along_y) {
+    if (door_count >= MAX_DOORS) return;
+    map_set(x, y, value);
+    map_set_extent(x, y, CELL_DOOR | (along_y ? CELL_ALONG_Y : 0), 0, 255);
+    doors[door_count++] = (Door){.x = x, .y = y};
+}
+
+// doors open while the player is close and close DOOR_HOLD seconds later
+void doors_update(Vector2 player_pos, float dt) {
+    for (int i = 0; i < door_count; i++) {
+        Door *d = &doors[i];
+        Vector2 center = {d->x + 0.5, d->y + 0.5};
+        if (Vector2Distance(center, player_pos) < DOOR_TRIGGER_DIST) {
+            d->hold = DOOR_HOLD;
+        } else if (d->hold > 0.0) {
+            d->hold -= dt;
+        }
+        float open = d->open + (d->hold > 0.0 ? dt : -dt) * DOOR_SPEED;
+        if (open < 0.0) open = 0.0;
+        if (open > 1.0) open = 1.0;
+        if (open == d->open) continue;
+        d->open = open;
+        map_set_extent(d->x, d->y, map_flags[d->y][d->x], open * 255, 255);
+    }
+}
+
+typedef struct {
+    int x, y;     // cell the wall is leaving
+    int dx, dy;
+    float offset; // progress into the next cell
+    int moved;
+    uint8_t value;
+} Pushwall;
+
+static Pushwall pushwalls[MAX_PUSHWALLS];
+static int pushwall_count = 0;
+
+// the block is split between the cell it leaves and the one it enters
+static void pushwall_set_extents(const Pushwall *w) {
+    uint8_t o = w->offset * 255;
+    uint8_t flags = CELL_PARTIAL | (w->dy ? CELL_ALONG_Y : 0);
+    if (w->dx + w->dy > 0) {
+        map_set_extent(w->x, w->y, flags, o, 255);
+        map_set_extent(w->x + w->dx, w->y + w->dy, flags, 0, o);
+    } else {
+        map_set_extent(w->x, w->y, flags, 0, 255 - o);
+        map_set_extent(w->x + w->dx, w->y + w->dy, flags, 255 - o, 255);
+    }
+}
+
+// open doors are passable, but a wall must not slide into one
+static bool pushwall_can_enter(int x, int y) {
+    return cell_passable(x, y) && !(map_flags[y][x] & CELL_DOOR);
+}
+
+bool pushwall_start(int x, int y, int dx, int dy) {
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS) return false;
+    if (!(map_flags[y][x] & CELL_PUSHABLE) || pushwall_count >= MAX_PUSHWALLS) return false;
+    if (!pushwall_can_enter(x + dx, y + dy)) return false;
+    Pushwall *w = &pushwalls[pushwall_count++];
+    *w = (Pushwall){.x = x, .y = y, .dx = dx, .dy = dy, .value = map[y][x]};
+    map_set(x + dx, y + dy, w->value);
+    pushwall_set_extents(w);
+    return true;
+}
+
+void pushwalls_update(float dt) {
+    for (int i = 0; i < pushwall_count;) {
+        Pushwall *w = &pushwalls[i];
+        w->offset += PUSHWALL_SPEED * dt;
+        if (w->offset < 1.0) {
+            pushwall_set_extents(w);
+            i++;
+            continue;
+        }
+        // settled in the next cell
+        map_set_extent(w->x, w->y, 0, 0, 0);
+        map_set(w->x, w->y, 0);
+        w->x += w->dx;
+        w->y += w->dy;
+        w->moved++;
+        w->offset = 0.0;
+        map_set_extent(w->x, w->y, 0, 0, 0);
+        if (w->moved < PUSHWALL_CELLS && pushwall_can_enter(w->x + w->dx, w->y + w->dy)) {
+            map_set(w->x + w->dx, w->y + w->dy, w->value);
+            pushwall_set_extents(w);
+            i++;
+        } else {
+            *w = pushwalls[--pushwall_count];
+        }
+    }
+}
+
+// pushes the wall in front of the player, along the axis it is facing most
+void player_use(const Player *p) {
+    Vector2 front = Vector2Add(p->pos, Vector2Scale(p->dir, PLAYER_RADIUS + 0.5));
+    int dx = 0, dy = 0;
+    if (fabs(p->dir.x) > fabs(p->dir.y)) {
+        dx = p->dir.x > 0 ? 1 : -1;
+    } else {
+        dy = p->dir.y > 0 ? 1 : -1;
+    }
+    pushwall_start(floorf(front.x), floorf(front.y), dx, dy);
+}
+
+// =================== LIGHTING ===================
+// Static light is baked once per level into a byte per wall face and one per
+// open cell (its floor and ceiling, and whatever stands in it). Rendering
+// looks the level up once per wall slice and turns it, with the distance,
+// into a color scale through shade_lut, so texels cost one multiply as before.
+
+typedef struct {
+    Vector2 pos;
+    float intensity; // levels added right at the light
+    float radius;    // no light reaches beyond this distance
+} PointLight;
+
+#define LIGHT_FACE_SAMPLES 3
+
+static const int face_normal[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+
+static uint8_t light_face[ROWS][COLS][4]; // level << 2 | corner bits, by FACE_*
+static uint8_t light_cell[ROWS][COLS];
+static uint8_t shade_lut[LIGHT_LEVELS][SHADE_DIST_STEPS];
+
+void shade_build_lut() {
+    for (int level = 0; level < LIGHT_LEVELS; level++) {
+        for (int i = 0; i < SHADE_DIST_STEPS; i++) {
+            float dist = (i + 0.5) / SHADE_DIST_SCALE;
+            float falloff = 0.1 + 1.0 / dist;
+            if (falloff > 1.0) falloff = 1.0;
+            shade_lut[level][i] = 255.0 * falloff * level / (LIGHT_LEVELS - 1);
+        }
+    }
+}
+
+// dist in raycast_walls units
+static inline uint8_t shade_scale(int level, float dist) {
+    int i = dist * SHADE_DIST_SCALE;
+    if (i >= SHADE_DIST_STEPS) i = SHADE_DIST_STEPS - 1;
+    return shade_lut[level][i];
+}
+
+static inline Color shade_color(Color c, uint8_t scale) {
+    c.r = c.r * (scale + 1) >> 8;
+    c.g = c.g * (scale + 1) >> 8;
+    c.b = c.b * (scale + 1) >> 8;
+    return c;
+}
+
+// light level reaching pos, lambert weighted when pos lies on a face with
+// the given normal (a zero normal lights from all around)
+static float light_gather(const PointLight *lights, int count, Vector2 pos, Vector2 normal) {
+    float level = LIGHT_AMBIENT;
+    bool on_face = normal.x != 0.0 || normal.y != 0.0;
+    for (int i = 0; i < count; i++) {
+        Vector2 d = Vector2Subtract(lights[i].pos, pos);
+        float dist = Vector2Length(d);
+        if (dist >= lights[i].radius) continue;
+        float lambert = on_face ? Vector2DotProduct(d, normal) / (dist + THRESHOLD) : 1.0;
+        if (lambert <= 0.0 || !line_of_sight(pos, lights[i].pos)) continue;
+        level += lights[i].intensity * lambert * (1.0 - dist / lights[i].radius);
+    }
+    return level < LIGHT_LEVELS - 1 ? level : LIGHT_LEVELS - 1;
+}
+
+// full walls darken the corners they make with a face
+static bool cell_occludes(int x, int y) {
+    if (x < 0 || x >= COLS || y < 0 || y >= ROWS) return false;
+    return map[y][x] && !cell_masked(map[y][x]) && !(map_flags[y][x] & (CELL_DOOR | CELL_PARTIAL));
+}
+
+// Bakes light_face and light_cell for the current map. Runs at load: doors and
+// pushwalls keep the light of the layout they started in. Empty cells get
+// faces too, for the pushwalls that settle there.
+void light_bake(const PointLight *lights, int count) {
+    for (int y = 0; y < ROWS; y++) {
+        for (int x = 0; x < COLS; x++) {
+            Vector2 center = {x + 0.5, y + 0.5};
+            light_cell[y][x] = light_gather(lights, count, center, Vector2Zero());
+            for (int f = 0; f < 4; f++) {
+                int nx = face_normal[f][0], ny = face_normal[f][1];
+                // the way u grows along the face, see ray_next
+                int tx = ny != 0, ty = -(nx != 0);
+                float level = 0.0;
+                for (int k = 0; k < LIGHT_FACE_SAMPLES; k++) {
+                    float u = (k + 0.5) / LIGHT_FACE_SAMPLES;
+                    Vector2 pos = {
+                        center.x + nx * 0.51 + tx * (u - 0.5),
+                        center.y + ny * 0.51 + ty * (u - 0.5),
+                    };
+                    level += light_gather(lights, count, pos, (Vector2){nx, ny});
+                }
+                uint8_t ao = cell_occludes(x + nx - tx, y + ny - ty) | cell_occludes(x + nx + tx, y + ny + ty) << 1;
+                light_face[y][x][f] = (int)(level / LIGHT_FACE_SAMPLES) << 2 | ao;
+            }
+        }
+    }
+}
+
+// Lights that change at runtime: torches flicker, flashes fade out. They are
+// not baked, rendering adds them per ray column on top of the static level.
+typedef struct {
+    PointLight light;
+    float z;       // height above the floor
+    float base;    // intensity before flicker, set by light_add
+    float fade;    // intensity lost per second, the light is removed at 0
+    float flicker; // random swing of the intensity, in levels
+} DynamicLight;
+
+static DynamicLight dynamic_lights[MAX_DYNAMIC_LIGHTS];
+static int dynamic_light_count = 0;
+
+// returns false when the pool is full
+bool light_add(DynamicLight l) {
+    if (dynamic_light_count >= MAX_DYNAMIC_LIGHTS) return false;
+    l.base = l.light.intensity;
+    dynamic_lights[dynamic_light_count++] = l;
+    return true;
+}
+
+void lights_update(float dt) {
+    for (int i = 0; i < dynamic_light_count;) {
+        DynamicLight *l = &dynamic_lights[i];
+        l->base -= l->fade * dt;
+        if (l->base <= 0.0) {
+            *l = dynamic_lights[--dynamic_light_count];
+            continue;
+        }
+        l->light.intensity = l->base;
+        if (l->flicker > 0.0) l->light.intensity += l->flicker * (rand() / (float)RAND_MAX - 0.5);
+        i++;
+    }
+}
+
+#ifdef DEBUG
+void draw_minimap_entities(const Entities *e) {
+    for (int i = 0; i < e->count; i++) {
+        Vector2 c = {e->pos_x[i] * MINIMAP_CELL_SCALE, e->pos_y[i] * MINIMAP_CELL_SCALE};
+        DrawCircleV(c, POINT_R, color_map[e->sprite[i]]);
+    }
+}
+#endif
+
+// =================== TEXTURES ===================
+// assets_map and assets_mask are the indirection from a map cell to its
+// texels. Animated textures get the entry of their current frame written
+// there once per tick, so the renderer never sees the animation.
+
+void textures_animate(float time) {
+    for (int id = 1; id < (int)ARRAY_LEN(assets_anim); id++) {
+        const TextureAnim *anim = assets_anim[id];
+        if (!anim) continue;
+        int frame = (int)(time * anim->fps) % anim->count;
+        assets_map[id] = anim->frames[frame];
+        assets_mask[id] = anim->masks[frame];
+    }
+}
+
+// =================== SKY ===================
+// Cylindrical panorama above the horizon, indexed by the yaw of each ray.
+
+static const Panorama *sky = NULL; // NULL: black above the horizon
+static uint16_t sky_rows[RENDER_H / 2]; // panorama row of every rendered row above the horizon
+
+void sky_set(const Panorama *panorama) {
+    sky = panorama;
+    if (!sky) return;
+    for (int y = 0; y < RENDER_H / 2; y++) {
+        sky_rows[y] = y * sky->h / (RENDER_H / 2);
+    }
+}
+
+// panorama column seen along dir
+static const pixel_t *sky_column(Vector2 dir) {
+    if (!sky) return NULL;
+    int u = (atan2f(dir.y, dir.x) + PI) / (2.0 * PI) * sky->w;
+    return sky->columns + (u % sky->w) * sky->h;
+}
+
+void init_game() {
+    map[1][3] = tx_bricks;
+    map[1][4] = 131;
+    map[1][5] = 129;
+    map[2][5] = tx_water;
+    map[3][4] = 129;
+    map[3][5] = tx_bricks;
+
+    map[7][7] = 130;
+    map[8][8] = 129;
+    map[9][9] = 134;
+    map[5][2] = tx_grate;
+    map[5][3] = tx_grate;
+
+    map_floor[3][5] = 4;
+    map_height[7][7] = 4;
+    map_height[8][8] = 12;
+    map_height[9][9] = 20;
+
+    // wall across the map, crossed through a door or a secret pushwall
+    for (int x = 0; x < COLS; x++) {
+        map[4][x] = tx_bricks2;
+    }
+    map_flags[4][1] = CELL_PUSHABLE;
+
+    flow_init(&flow);
+    door_add(6, 4, tx_bricks, false);
+    map_build_derived();
+
+    static const PointLight lights[] = {
+        {{1.5, 1.5}, 40.0, 5.0},
+        {{6.5, 2.5}, 48.0, 6.0},
+        {{2.5, 7.5}, 40.0, 5.0},
+        {{7.5, 6.0}, 32.0, 4.0},
+    };
+    shade_build_lut();
+    light_bake(lights, ARRAY_LEN(lights));
+    light_add((DynamicLight){.light = {{4.5, 5.5}, 24.0, 3.0}, .z = 0.8, .flicker = 8.0});
+    sky_set(&assets_panorama[pn_sky]);
+
+    entities_init(&entities);
+    entity_spawn(&entities, (Vector2){8.5, 2.5}, 0, ENTITY_ENEMY);
+    entity_spawn(&entities, (Vector2){6.5, 8.5}, 0, ENTITY_ENEMY);
+    entity_spawn(&entities, (Vector2){2.5, 6.5}, 0, ENTITY_ENEMY);
+    entity_spawn(&entities, (Vector2){4.5, 2.5}, 3, ENTITY_PICKUP);
+    entity_spawn(&entities, (Vector2){1.5, 8.5}, 3, ENTITY_PICKUP);
+    entities_build_hash(&entities);
+}
+
+// =================== RENDERING ===================
+
+#define RAY_COLS ((SCREEN_W + RAY_RES - 1) / RAY_RES) // most columns a frame can have
+
+// Screen columns, one ray each, laid out once at startup: RAY_RES wide
+// everywhere, or with FOVEATED, RAY_RES in the center third of the screen
+// and 2 then 4 times wider towards the edges.
+typedef struct {
+    int x, w;       // screen span
+    float cos, sin; // rotation of the ray from the view direction
+} RayColumn;
+
+static RayColumn ray_columns[RAY_COLS];
+static int ray_column_count = 0;
+static uint16_t column_at_x[SCREEN_W];
+static int frame_rays = 0; // rays cast by the last draw_walls
+static int frame_span_cols = 0; // columns of it that took their first hit from a face span
+
+// With INTERLACED, every frame casts the columns of one parity and keeps the
+// others from the frame before, scrolled by the view rotation since then.
+// Only the ESP32 framebuffer survives a frame, the host casts every column.
+#if defined(INTERLACED) && defined(ESP32)
+    #define INTERLACE 2
+    #define mark_dirty(x, w) PresentColumns(x, w) // only changed columns go out on SPI
+#else
+    #define INTERLACE 1
+    #define mark_dirty(x, w) ((void)(x), (void)(w))
+#endif
+static int interlace_field = 0; // parity of the columns cast next
+
+#if INTERLACE > 1
+// x painted over the walls since they were cast: sprites and overlays. The
+// columns under them are cast next frame whatever their parity, so a kept
+// column never carries an old sprite or a scrolled copy of the HUD.
+static bool interlace_overdrawn[SCREEN_W];
+
+static void mark_overdrawn(int x, int w) {
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (x + w > SCREEN_W) w = SCREEN_W - x;
+    if (w > 0) memset(&interlace_overdrawn[x], true, w);
+}
+
+static bool column_overdrawn(const RayColumn *rc) {
+    for (int x = rc->x; x < rc->x + rc->w; x++) {
+        if (interlace_overdrawn[x]) return true;
+    }
+    return false;
+}
+#else
+    #define mark_overdrawn(x, w) ((void)(x), (void)(w))
+#endif
+
+static int column_stride(int x) {
+    #ifdef FOVEATED
+    int d = abs(2 * x - SCREEN_W); // distance from the center, in half pixels
+    if (d >= SCREEN_W * 2 / 3) return RAY_RES * 4;
+    if (d >= SCREEN_W / 3) return RAY_RES * 2;
+    #else
+    (void)x;
+    #endif
+    return RAY_RES;
+}
+
+void ray_columns_init() {
+    int n = 0;
+    for (int x = 0; x < SCREEN_W; n++) {
+        int w = column_stride(x);
+        if (x + w > SCREEN_W) w = SCREEN_W - x;
+        // the ray goes through the left edge of a RAY_RES column, through
+        // the middle of the RAY_RES wide part of a wider one
+        float ray_x = w > RAY_RES ? x + (w - RAY_RES) / 2.0 : x;
+        float angle = -FOV_ANGLE / 2.0 + ray_x * FOV_ANGLE / SCREEN_W;
+        ray_columns[n] = (RayColumn){.x = x, .w = w, .cos = cosf(angle), .sin = sinf(angle)};
+        for (int i = x; i < x + w; i++) {
+            column_at_x[i] = n;
+        }
+        x += w;
+    }
+    ray_column_count = n;
+}
+
+// nearest wall of every ray of the frame, distance in raycast_walls units and
+// top row, for sprite occlusion
+static float column_depth[RAY_COLS];
+static int column_top[RAY_COLS];
+// nearest masked wall of every ray: distance, the rows from which down the
+// column was final once it was drawn, and the rows its texels covered above
+static float column_masked_depth[RAY_COLS];
+static int column_masked_clip[RAY_COLS];
+static uint32_t column_masked_bits[RAY_COLS][(RENDER_H + 31) / 32];
+
+#ifdef COST_HEATMAP
+// Ticks of the last cast of every column, walking the grid and shading (wall
+// slices and background) apart, or with COST_HEATMAP_ACCUMULATE their sums
+// over every frame so far. A column costs the same whatever its width.
+static uint64_t column_traverse_ticks[RAY_COLS];
+static uint64_t column_shade_ticks[RAY_COLS];
+static bool column_cast[RAY_COLS]; // since the overlay was last drawn
+
+static void cost_column(int col, uint32_t ticks, uint32_t shade_ticks) {
+    uint32_t traverse_ticks = ticks > shade_ticks ? ticks - shade_ticks : 0;
+    column_cast[col] = true;
+    #ifdef COST_HEATMAP_ACCUMULATE
+    column_traverse_ticks[col] += traverse_ticks;
+    column_shade_ticks[col] += shade_ticks;
+    #else
+    column_traverse_ticks[col] = traverse_ticks;
+    column_shade_ticks[col] = shade_ticks;
+    #endif
+}
+#endif
+
+#if INTERLACE > 1
+static float interlace_angle = 0.0; // view angle of the frame on screen
+static bool interlace_ready = false;
+
+// Columns are spread evenly in angle, so a rotation moves the frame on screen
+// sideways. Scrolls it by the rotation since the last frame and narrows
+// [*x0, *x1) to the span it uncovered, the whole screen when there is no
+// usable frame: those columns are cast whatever their parity.
+static void interlace_scroll(Player p, int *x0, int *x1) {
+    float angle = atan2f(p.dir.y, p.dir.x);
+    float delta = angle - interlace_angle;
+    if (delta > PI) delta -= 2 * PI;
+    if (delta < -PI) delta += 2 * PI;
+    interlace_angle = angle;
+    // the shim scrolls 32-bit words
+    int shift = -2 * (int)roundf(delta / FOV_ANGLE * SCREEN_W / 2.0);
+    if (!interlace_ready || abs(shift) >= SCREEN_W / 2) {
+        interlace_ready = true;
+        mark_dirty(0, SCREEN_W);
+        return;
+    }
+    if (shift == 0) {
+        *x0 = *x1 = 0;
+        return;
+    }
+    ScrollFrame(shift, RENDER_H);
+    mark_dirty(0, SCREEN_W);
+    *x0 = shift > 0 ? 0 : SCREEN_W + shift;
+    *x1 = shift > 0 ? shift : SCREEN_W;
+    // what was drawn over the walls went along
+    if (shift > 0) {
+        memmove(interlace_overdrawn + shift, interlace_overdrawn, SCREEN_W - shift);
+    } else {
+        memmove(interlace_overdrawn, interlace_overdrawn - shift, SCREEN_W + shift);
+    }
+
+    // the depth of the kept columns moves along, sprites clip against it
+    static float prev_depth[RAY_COLS], prev_masked_depth[RAY_COLS];
+    static int prev_top[RAY_COLS], prev_masked_clip[RAY_COLS];
+    static uint32_t prev_masked_bits[RAY_COLS][(RENDER_H + 31) / 32];
+    memcpy(prev_depth, column_depth, sizeof(prev_depth));
+    memcpy(prev_top, column_top, sizeof(prev_top));
+    memcpy(prev_masked_depth, column_masked_depth, sizeof(prev_masked_depth));
+    memcpy(prev_masked_clip, column_masked_clip, sizeof(prev_masked_clip));
+    memcpy(prev_masked_bits, column_masked_bits, sizeof(prev_masked_bits));
+    for (int col = 0; col < ray_column_count; col++) {
+        int x = ray_columns[col].x + ray_columns[col].w / 2 - shift;
+        if (x < 0 || x >= SCREEN_W) continue;
+        int from = column_at_x[x];
+        column_depth[col] = prev_depth[from];
+        column_top[col] = prev_top[from];
+        column_masked_depth[col] = prev_masked_depth[from];
+        column_masked_clip[col] = prev_masked_clip[from];
+        memcpy(column_masked_bits[col], prev_masked_bits[from], sizeof(column_masked_bits[col]));
+    }
+}
+#endif
+
+// dynamic lights reaching each ray column this frame, strongest first
+static uint8_t column_lights[RAY_COLS][MAX_COLUMN_LIGHTS];
+static uint8_t column_light_count[RAY_COLS];
+
+// Spreads every dynamic light over the columns its radius can cover, most
+// intense at the player first, keeping at most MAX_COLUMN_LIGHTS per column.
+// Walls do not block dynamic light, only faces turned away are skipped.
+void light_cull_columns(Player p) {
+    memset(column_light_count, 0, sizeof(column_light_count));
+    uint8_t order[MAX_DYNAMIC_LIGHTS];
+    float weight[MAX_DYNAMIC_LIGHTS];
+    int n = 0;
+    for (int i = 0; i < dynamic_light_count; i++) {
+        const PointLight *l = &dynamic_lights[i].light;
+        Vector2 rel = Vector2Subtract(l->pos, p.pos);
+        float dist = Vector2Length(rel);
+        if (Vector2DotProduct(rel, p.dir) < -l->radius || dist - l->radius > MAX_RENDER_DIST) continue;
+        float w = l->intensity / (1.0 + dist);
+        int k = n++;
+        for (; k > 0 && weight[k - 1] < w; k--) {
+            order[k] = order[k - 1];
+            weight[k] = weight[k - 1];
+        }
+        order[k] = i;
+        weight[k] = w;
+    }
+
+    Vector2 right = Vector2Rotate(p.dir, PI / 2.0);
+    for (int k = 0; k < n; k++) {
+        const PointLight *l = &dynamic_lights[order[k]].light;
+        Vector2 rel = Vector2Subtract(l->pos, p.pos);
+        float dist = Vector2Length(rel);
+        int c0 = 0, c1 = ray_column_count - 1;
+        if (dist > l->radius) {
+            float angle = atan2f(Vector2DotProduct(rel, right), Vector2DotProduct(rel, p.dir));
+            float half = asinf(l->radius / dist);
+            float x0 = (angle - half + FOV_ANGLE / 2.0) / FOV_ANGLE * SCREEN_W;
+            float x1 = (angle + half + FOV_ANGLE / 2.0) / FOV_ANGLE * SCREEN_W;
+            if (x1 < 0.0 || x0 >= SCREEN_W) continue;
+            if (x0 > 0.0) c0 = column_at_x[(int)x0];
+            if (x1 < SCREEN_W) c1 = column_at_x[(int)x1];
+        }
+        for (int c = c0; c <= c1; c++) {
+            if (column_light_count[c] < MAX_COLUMN_LIGHTS) column_lights[c][column_light_count[c]++] = order[k];
+        }
+    }
+}
+
+// dynamic light level at a point seen through the column, lambert weighted
+// when the point lies on a face with the given normal
+static float column_light_at(int col, Vector2 pos, float z, Vector2 normal) {
+    float level = 0.0;
+    bool on_face = normal.x != 0.0 || normal.y != 0.0;
+    for (int k = 0; k < column_light_count[col]; k++) {
+        const DynamicLight *l = &dynamic_lights[column_lights[col][k]];
+        float dx = l->light.pos.x - pos.x;
+        float dy = l->light.pos.y - pos.y;
+        float dz = l->z - z;
+        float dist = sqrtf(dx * dx + dy * dy + dz * dz);
+        if (dist >= l->light.radius) continue;
+        float lambert = on_face ? (dx * normal.x + dy * normal.y) / (dist + THRESHOLD) : 1.0;
+        if (lambert <= 0.0) continue;
+        level += l->light.intensity * lambert * (1.0 - dist / l->light.radius);
+    }
+    return level;
+}
+
+#ifdef DEBUG
+// end of the traced segment, clipped to the minimap area
+Vector2 minimap_ray_end(Vector2 origin, Vector2 dir, float dist) {
+    float tx = ((dir.x >= 0 ? COLS : -1.0) - origin.x) / (dir.x != 0.0 ? dir.x : THRESHOLD);
+    float ty = ((dir.y >= 0 ? ROWS : -1.0) - origin.y) / (dir.y != 0.0 ? dir.y : THRESHOLD);
+    if (tx < dist) dist = tx;
+    if (ty < dist) dist = ty;
+    if (dist < 0.0) dist = 0.0;
+    return Vector2Add(origin, Vector2Scale(dir, dist));
+}
+
+// Traced rays are collected while casting and drawn over the minimap in one
+// go, every MINIMAP_RAY_STEP-th column only.
+#ifndef MINIMAP_RAY_STEP
+#define MINIMAP_RAY_STEP 1
+#endif
+
+static Vector2 minimap_rays[RAY_COLS]; // ends, in minimap pixels
+static int minimap_ray_count = 0;
+
+void draw_minimap_rays(Vector2 origin) {
+    Vector2 o = Vector2Scale(origin, MINIMAP_CELL_SCALE);
+    for (int k = 0; k < minimap_ray_count; k++) {
+        DrawLineEx(o, minimap_rays[k], LINE_THICKNESS, BLUE);
+    }
+}
+#endif
+
+// Occlusion state of the column being drawn. Rows at and below clip are
+// final. Above it, masked walls may have filled scattered rows, tracked in
+// bits (only valid once masked is set, so opaque-only columns skip the reset).
+typedef struct {
+    int clip;
+    bool masked;
+    uint32_t bits[(RENDER_H + 31) / 32];
+} ColumnCover;
+
+static inline bool cover_test(const ColumnCover *c, int y) {
+    return (c->bits[y >> 5] >> (y & 31)) & 1;
+}
+
+static inline void cover_set(ColumnCover *c, int y) {
+    c->bits[y >> 5] |= 1u << (y & 31);
+}
+
+// fills rows [from, to) of the slice, skipping rows masked walls already drew
+static void draw_uncovered(int col, int from, int to, Color c, const ColumnCover *cover) {
+    if (!cover->masked) {
+        if (to > from) DrawViewRectangle(ray_columns[col].x, from, ray_columns[col].w, to - from, c);
+        return;
+    }
+    int y = from;
+    while (y < to) {
+        while (y < to && cover_test(cover, y)) y++;
+        int start = y;
+        while (y < to && !cover_test(cover, y)) y++;
+        if (y > start) DrawViewRectangle(ray_columns[col].x, start, ray_columns[col].w, y - start, c);
+    }
+}
+
+// Shaded rows ready for draw_column_pixels: framebuffer pixels on the ESP32,
+// copied as they are, colors for raylib on the host.
+#ifdef ESP32
+    typedef uint16_t SlicePixel;
+    #define slice_pixel(color) ColorToInt(color)
+#else
+    typedef Color SlicePixel;
+    #define slice_pixel(color) (color)
+#endif
+
+// rows [y, y + n) of the slice, one pixel each
+static void draw_column_pixels(int col, int y, int n, const SlicePixel *pixels) {
+    #ifdef ESP32
+    DrawColumn(ray_columns[col].x, y, ray_columns[col].w, n, pixels);
+    #else
+    for (int i = 0; i < n; i++) DrawViewRectangle(ray_columns[col].x, y + i, ray_columns[col].w, 1, pixels[i]);
+    #endif
+}
+
+static inline int background_key(const pixel_t *sky_col, int y) {
+    return sky_col && y < RENDER_H / 2 ? sky_rows[y] : -1;
+}
+
+// Rows [from, to) of the column that no wall drew: the sky column above the
+// horizon, black below it. The frame is never cleared, so together with the
+// walls every pixel is written once. Rows on the same panorama texel go out
+// as one rectangle.
+static void draw_background(int col, const pixel_t *sky_col, int from, int to, const ColumnCover *cover) {
+    int y = from;
+    while (y < to) {
+        if (cover->masked && cover_test(cover, y)) {
+            y++;
+            continue;
+        }
+        int key = background_key(sky_col, y);
+        int end = y + 1;
+        while (end < to && background_key(sky_col, end) == key && !(cover->masked && cover_test(cover, end))) end++;
+        if (key >= 0) COST_TEXEL(&sky_col[key]);
+        DrawViewRectangle(ray_columns[col].x, y, ray_columns[col].w, end - y, key >= 0 ? GetColor(sky_col[key]) : BLACK);
+        y = end;
+    }
+}
+
+// Opaque texels of a masked wall, walked run by run from assets_mask so
+// transparent texels are never looked at. Every row drawn is marked covered.
+static void draw_masked_texels(int col, const pixel_t *tex, const TextureMask *mask, int texture_x,
+                               float y_top, float unit_h, int row_top, int row_end,
+                               uint8_t scale, ColumnCover *cover) {
+    const uint8_t *runs = mask->runs + mask->index[texture_x];
+    int n = runs[0];
+    for (float tile_y = y_top; tile_y < row_end; tile_y += unit_h) {
+        for (int r = 0; r < n; r++) {
+            int first = runs[1 + 2 * r];
+            int last = runs[2 + 2 * r] - 1;
+            int from = tile_y + first * unit_h / TEXTURE_SIZE;
+            int to = tile_y + (last + 1) * unit_h / TEXTURE_SIZE;
+            if (from < row_top) from = row_top;
+            if (to > row_end) to = row_end;
+            for (int y = from; y < to; y++) {
+                if (cover_test(cover, y)) continue;
+                int texture_y = (y - tile_y) * TEXTURE_SIZE / unit_h;
+                if (texture_y < first) texture_y = first;
+                if (texture_y > last) texture_y = last;
+                pixel_t texel = tex[texture_y * TEXTURE_SIZE + texture_x];
+                COST_TEXEL(&tex[texture_y * TEXTURE_SIZE + texture_x]);
+                DrawViewRectangle(ray_columns[col].x, y, ray_columns[col].w, 1, shade_color(GetColor(texel), scale));
+                cover_set(cover, y);
+            }
+        }
+    }
+}
+
+// Baked light of a wall slice. Doors and moving pushwalls take the light of
+// their cell, full walls the one of the face, dimmed towards the corners.
+static int wall_light(const RayHit *hit) {
+    int cx = hit->cell_x, cy = hit->cell_y;
+    if (map_flags[cy][cx] & (CELL_DOOR | CELL_PARTIAL)) return light_cell[cy][cx];
+    uint8_t b = light_face[cy][cx][hit->face];
+    float level = b >> 2;
+    if ((b & 1) && hit->u < LIGHT_AO_WIDTH) {
+        level *= LIGHT_AO_DEPTH + (1.0 - LIGHT_AO_DEPTH) * hit->u / LIGHT_AO_WIDTH;
+    }
+    if ((b & 2) && hit->u > 1.0 - LIGHT_AO_WIDTH) {
+        level *= LIGHT_AO_DEPTH + (1.0 - LIGHT_AO_DEPTH) * (1.0 - hit->u) / LIGHT_AO_WIDTH;
+    }
+    return level;
+}
+
+// where the ray met the face, doors and moving pushwalls use their cell center
+static Vector2 hit_point(const RayHit *hit) {
+    float cx = hit->cell_x, cy = hit->cell_y;
+    if (map_flags[hit->cell_y][hit->cell_x] & (CELL_DOOR | CELL_PARTIAL)) return (Vector2){cx + 0.5, cy + 0.5};
+    switch (hit->face) {
+    case FACE_WEST: return (Vector2){cx, cy + 1.0 - hit->u};
+    case FACE_EAST: return (Vector2){cx + 1.0, cy + 1.0 - hit->u};
+    case FACE_NORTH: return (Vector2){cx + hit->u, cy};
+    default: return (Vector2){cx + hit->u, cy + 1.0};
+    }
+}
+
+// Shaded rows [row_top, row_end) of an opaque texture slice, resampled into
+// rows. The texture repeats every map unit, counted down from the wall top.
+static void slice_resample(SlicePixel *rows, uint8_t map_cell, int texture_x, float y_top, float unit_h,
+                           uint8_t scale_top, uint8_t scale_base, float y_base, int row_top, int row_end) {
+    const pixel_t *tex = assets_map[map_cell];
+    int scale_fp = scale_top << 8;
+    int scale_step = 0;
+    if (scale_base != scale_top) {
+        scale_step = ((scale_base - scale_top) << 8) / (y_base - y_top);
+        scale_fp += scale_step * (row_top - y_top);
+    }
+    for (int y = row_top; y < row_end; y++, scale_fp += scale_step) {
+        int texture_y = (int)((y - y_top) * TEXTURE_SIZE / unit_h) & (TEXTURE_SIZE - 1);
+        pixel_t texel = tex[texture_y * TEXTURE_SIZE + texture_x];
+        COST_TEXEL(&tex[texture_y * TEXTURE_SIZE + texture_x]);
+        rows[y] = slice_pixel(shade_color(GetColor(texel), scale_fp >> 8));
+    }
+}
+
+#ifdef ESP32
+// RAY_RES columns are wider than a texel unless the wall is very close, so
+// neighbouring columns almost never repeat a slice: a cache hit on 0.3% of
+// the benchmark's slices, 0.8% with FB_ROW_SCALE 2, and cost a copy on every
+// miss. Every slice is resampled straight into one column.
+static const SlicePixel *slice_rows(uint8_t map_cell, int texture_x, float y_top, float unit_h,
+                                    uint8_t scale_top, uint8_t scale_base, float y_base,
+                                    int row_top, int row_end) {
+    static SlicePixel rows[RENDER_H];
+    slice_resample(rows, map_cell, texture_x, y_top, unit_h, scale_top, scale_base, y_base, row_top, row_end);
+    return rows;
+}
+#else
+// Shaded texture slices drawn this frame. Head-on walls repeat the same slice
+// over neighbouring columns, which then only copy it. Positions are keyed in
+// 1/16 of a row, close enough that a hit looks the same as a resample.
+#define SLICE_CACHE_SLOTS 32
+
+typedef struct {
+    uint32_t frame; // valid during this frame only
+    uint8_t map_cell, texture_x, scale_top, scale_base;
+    int y_top, unit_h;
+    int row_top, row_end; // rows held
+    SlicePixel rows[RENDER_H];
+} SliceCacheSlot;
+
+static SliceCacheSlot slice_cache[SLICE_CACHE_SLOTS];
+static uint32_t slice_cache_frame = 1;
+static uint32_t slice_cache_hits = 0;
+static uint32_t slice_cache_misses = 0;
+
+// the rows from the cache, or resampled into the slot the slice maps to
+static const SlicePixel *slice_rows(uint8_t map_cell, int texture_x, float y_top, float unit_h,
+                                    uint8_t scale_top, uint8_t scale_base, float y_base,
+                                    int row_top, int row_end) {
+    int y_top_fp = y_top * 16.0;
+    int unit_h_fp = unit_h * 16.0;
+    SliceCacheSlot *slot = &slice_cache[(map_cell * 61 + texture_x * 7 + unit_h_fp) % SLICE_CACHE_SLOTS];
+    if (slot->frame == slice_cache_frame && slot->map_cell == map_cell && slot->texture_x == texture_x &&
+        slot->y_top == y_top_fp && slot->unit_h == unit_h_fp &&
+        slot->scale_top == scale_top && slot->scale_base == scale_base &&
+        slot->row_top <= row_top && slot->row_end >= row_end) {
+        slice_cache_hits++;
+        return slot->rows;
+    }
+    slice_cache_misses++;
+    *slot = (SliceCacheSlot){
+        .frame = slice_cache_frame, .map_cell = map_cell, .texture_x = texture_x,
+        .scale_top = scale_top, .scale_base = scale_base,
+        .y_top = y_top_fp, .unit_h = unit_h_fp, .row_top = row_top, .row_end = row_end,
+    };
+    slice_resample(slot->rows, map_cell, texture_x, y_top, unit_h, scale_top, scale_base, y_base, row_top, row_end);
+    return slot->rows;
+}
+#endif
+
+static inline int clamp_level(float level) {
+    return level < LIGHT_LEVELS - 1 ? level : LIGHT_LEVELS - 1;
+}
+
+// Draws the part of the wall slice that is still uncovered and tightens the
+// column occlusion: opaque walls lower clip to their top row, masked walls
+// only mark the rows they drew.
+void draw_wall_slice(const RayHit *hit, float dist, int col, ColumnCover *cover) {
+    uint8_t map_cell = hit->value;
+    float unit_h = RENDER_H / dist;
+    float horizon = RENDER_H / 2.0;
+    float y_top = horizon - (cell_top(hit->cell_x, hit->cell_y) - EYE_HEIGHT) * unit_h;
+    float y_base = horizon - (cell_base(hit->cell_x, hit->cell_y) - EYE_HEIGHT) * unit_h;
+    float y_ground = horizon + EYE_HEIGHT * unit_h;
+    int clip = cover->clip;
+    int row_top = y_top > 0.0 ? (int)y_top : 0;
+    int row_base = y_base < clip ? (int)y_base : clip;
+    int row_ground = y_ground < clip ? (int)y_ground : clip;
+    if (row_top >= clip) return;
+
+    // static light plus the dynamic lights of the column, evaluated once, or
+    // at both ends of tall slices and interpolated down the texture loop
+    int level_top = wall_light(hit);
+    int level_base = level_top;
+    if (column_light_count[col]) {
+        Vector2 point = hit_point(hit);
+        Vector2 normal = Vector2Zero();
+        if (!(map_flags[hit->cell_y][hit->cell_x] & (CELL_DOOR | CELL_PARTIAL))) {
+            normal = (Vector2){face_normal[hit->face][0], face_normal[hit->face][1]};
+        }
+        float base = cell_base(hit->cell_x, hit->cell_y);
+        float top = cell_top(hit->cell_x, hit->cell_y);
+        if (y_base - y_top > LIGHT_TALL_ROWS) {
+            level_top = clamp_level(level_top + column_light_at(col, point, top, normal));
+            level_base = clamp_level(level_base + column_light_at(col, point, base, normal));
+        } else {
+            level_top = level_base = clamp_level(level_top + column_light_at(col, point, (base + top) / 2.0, normal));
+        }
+    }
+    uint8_t scale_top = shade_scale(level_top, dist);
+    uint8_t scale_base = shade_scale(level_base, dist);
+    uint8_t scale = (scale_top + scale_base) / 2;
+
+    int plinth_top = row_ground;
+    if (row_base < row_ground) {
+        // plinth under a raised floor
+        plinth_top = row_base > row_top ? row_base : row_top;
+        draw_uncovered(col, plinth_top, row_ground, shade_color(DARKGRAY, scale), cover);
+    }
+    if (row_top < row_base) {
+        if (map_cell >= 128) {
+            // color
+            Color c = shade_color(color_map[map_cell - 128], scale);
+            draw_uncovered(col, row_top, row_base, c, cover);
+        } else {
+            const pixel_t *tex = assets_map[map_cell];
+            int texture_x = (int)(hit->u * TEXTURE_SIZE) & (TEXTURE_SIZE - 1);
+
+            if (cell_masked(map_cell)) {
+                if (!cover->masked) {
+                    memset(cover->bits, 0, sizeof(cover->bits));
+                    cover->masked = true;
+                }
+                draw_masked_texels(col, tex, assets_mask[map_cell], texture_x,
+                    y_top, unit_h, row_top, row_base, scale, cover);
+                cover->clip = plinth_top;
+                while (cover->clip > 0 && cover_test(cover, cover->clip - 1)) cover->clip--;
+                return;
+            }
+
+            if (!cover->masked) {
+                const SlicePixel *rows = slice_rows(map_cell, texture_x, y_top, unit_h,
+                    scale_top, scale_base, y_base, row_top, row_base);
+                draw_column_pixels(col, row_top, row_base - row_top, rows + row_top);
+                cover->clip = row_top;
+                return;
+            }
+
+            // behind a masked wall, only the rows it left open
+            int scale_fp = scale_top << 8;
+            int scale_step = 0;
+            if (scale_base != scale_top) {
+                scale_step = ((scale_base - scale_top) << 8) / (y_base - y_top);
+                scale_fp += scale_step * (row_top - y_top);
+            }
+            for (int y = row_top; y < row_base; y++, scale_fp += scale_step) {
+                if (cover->masked && cover_test(cover, y)) continue;
+                int texture_y = (int)((y - y_top) * TEXTURE_SIZE / unit_h) & (TEXTURE_SIZE - 1);
+                pixel_t texel = tex[texture_y * TEXTURE_SIZE + texture_x];
+                COST_TEXEL(&tex[texture_y * TEXTURE_SIZE + texture_x]);
+                DrawViewRectangle(ray_columns[col].x, y, ray_columns[col].w, 1, shade_color(GetColor(texel), scale_fp >> 8));
+            }
+        }
+    }
+    cover->clip = row_top;
+}
+
+// Walks the ray front to back. Solid walls only ever grow upwards from the
+// floor, so the highest row drawn so far is the occlusion bound: each wall is
+// clipped to the rows above it and no pixel is written twice. Masked walls do
+// not end the ray, up to MAX_MASKED_HITS of them are composited in front of
+// what comes next, one more ends it. The walk stops once the column is covered, or once the
+// tallest wall of the map, placed at the current distance, would not reach
+// above the bound any more. The floor between a wall and what was drawn
+// before it is filled as the wall is reached, what is left above the bound
+// at the end is background.
+static Vector2 column_dir(Player p, int col) {
+    const RayColumn *rc = &ray_columns[col];
+    return (Vector2){p.dir.x * rc->cos - p.dir.y * rc->sin, p.dir.x * rc->sin + p.dir.y * rc->cos};
+}
+
+// first is NULL to walk from the eye, else the first hit of the column,
+// already found (value 0 if the ray meets nothing), the walk goes on behind it
+void raycast_walls(Player p, int col, const RayHit *first) {
+    Vector2 dir = column_dir(p, col);
+    float cos_angle = ray_columns[col].cos;
+    float horizon = RENDER_H / 2.0;
+    ColumnCover cover;
+    cover.clip = RENDER_H;
+    cover.masked = false;
+    int masked_hits = 0;
+    column_depth[col] = MAX_RENDER_DIST;
+    column_top[col] = RENDER_H;
+    column_masked_depth[col] = MAX_RENDER_DIST;
+    #ifdef COST_COUNTERS
+    uint32_t cast_start = cost_now();
+    uint64_t cells_start = cost.cells - cost_probe_cells; // the probe walked the start of this ray
+    cost_probe_cells = 0;
+    #endif
+    #ifdef COST_HEATMAP
+    uint32_t shade_ticks = 0;
+    uint32_t shade_start;
+    #endif
+    const pixel_t *sky_col = sky_column(dir);
+
+    RayWalk w;
+    RayHit hit;
+    ray_begin(&w, p.pos, dir);
+    bool pending = false; // hit holds a first hit not drawn yet
+    bool walk = true;
+    if (first) {
+        hit = *first;
+        pending = walk = first->value != 0;
+        if (walk) ray_seek(&w, first);
+    } else {
+        frame_rays++;
+    }
+    #ifdef DEBUG
+    float first_dist = MAX_RENDER_DIST;
+    #endif
+    while (cover.clip > 0 && (pending || (walk && ray_next(&w, MAX_RENDER_DIST, &hit)))) {
+        pending = false;
+        float dist = hit.dist * cos_angle / ASPECT_RATIO;
+        if (horizon - (map_max_top - EYE_HEIGHT) * RENDER_H / dist >= cover.clip) break;
+        bool masked = cell_masked(hit.value);
+        if (masked && ++masked_hits > MAX_MASKED_HITS) break;
+        #ifdef DEBUG
+        if (first_dist == MAX_RENDER_DIST) first_dist = hit.dist;
+        #endif
+        #ifdef COST_HEATMAP
+        shade_start = cost_now();
+        #endif
+        // floor in front of the wall, below its ground row: nearer than the
+        // wall, farther than anything drawn so far (a grate or a low wall)
+        float y_ground = horizon + EYE_HEIGHT * RENDER_H / dist;
+        if (y_ground < cover.clip) draw_background(col, sky_col, (int)y_ground, cover.clip, &cover);
+        draw_wall_slice(&hit, dist, col, &cover);
+        #ifdef COST_HEATMAP
+        shade_ticks += cost_now() - shade_start;
+        #endif
+        if (!masked && column_depth[col] == MAX_RENDER_DIST) {
+            column_depth[col] = dist;
+            column_top[col] = cover.clip;
+        } else if (masked && cover.masked && column_masked_depth[col] == MAX_RENDER_DIST) {
+            // sprites behind it show through its holes only
+            column_masked_depth[col] = dist;
+            column_masked_clip[col] = cover.clip;
+            memcpy(column_masked_bits[col], cover.bits, sizeof(cover.bits));
+        }
+    }
+    #ifdef COST_HEATMAP
+    shade_start = cost_now();
+    #endif
+    draw_background(col, sky_col, 0, cover.clip, &cover);
+    #ifdef COST_HEATMAP
+    shade_ticks += cost_now() - shade_start;
+    #endif
+    #ifdef DEBUG
+    if (col % MINIMAP_RAY_STEP == 0) {
+        minimap_rays[minimap_ray_count++] = Vector2Scale(minimap_ray_end(p.pos, dir, first_dist), MINIMAP_CELL_SCALE);
+    }
+    #endif
+    #ifdef COST_COUNTERS
+    uint32_t cast_ticks = cost_now() - cast_start;
+    cost_ray(cost.cells - cells_start);
+    cost.cast_ticks += cast_ticks;
+    #endif
+    #ifdef COST_HEATMAP
+    cost_column(col, cast_ticks, shade_ticks);
+    #endif
+}
+
+#ifdef COST_HEATMAP
+// Columns colored by their cost against the most expensive one: dark blue
+// for nothing through red to yellow. The overlay is a strip along the bottom
+// of the view, the dump a bar chart with the grid walk at the bottom of each
+// bar and the shading, lighter, on top of it. The overlay is only redrawn on
+// the columns cast since, interlaced frames keep it with the others.
+#define COST_HEATMAP_ROWS (RENDER_H / 16)
+#define COST_HEATMAP_DUMP_H 256
+#ifndef COST_HEATMAP_FILE
+#define COST_HEATMAP_FILE "cost_heatmap.ppm"
+#endif
+
+static Color heat_color(float t) {
+    Color from = t < 0.5 ? DARKBLUE : RED;
+    Color to = t < 0.5 ? RED : YELLOW;
+    float f = t < 0.5 ? t * 2.0 : t * 2.0 - 1.0;
+    Color c = from;
+    c.r = from.r + (to.r - from.r) * f;
+    c.g = from.g + (to.g - from.g) * f;
+    c.b = from.b + (to.b - from.b) * f;
+    return c;
+}
+
+static uint64_t heat_max() {
+    uint64_t max = 0;
+    for (int col = 0; col < ray_column_count; col++) {
+        uint64_t ticks = column_traverse_ticks[col] + column_shade_ticks[col];
+        if (ticks > max) max = ticks;
+    }
+    return max;
+}
+
+void draw_cost_heatmap() {
+    uint64_t max = heat_max();
+    if (max == 0) return;
+    for (int col = 0; col < ray_column_count; col++) {
+        if (!column_cast[col]) continue;
+        column_cast[col] = false;
+        float t = (float)(column_traverse_ticks[col] + column_shade_ticks[col]) / max;
+        DrawViewRectangle(ray_columns[col].x, RENDER_H - COST_HEATMAP_ROWS, ray_columns[col].w, COST_HEATMAP_ROWS, heat_color(t));
+    }
+}
+
+#ifndef ESP32
+void cost_heatmap_dump() {
+    uint64_t max = heat_max();
+    FILE *f = fopen(COST_HEATMAP_FILE, "wb");
+    if (max == 0 || !f) {
+        if (f) fclose(f);
+        return;
+    }
+    static uint8_t rgb[COST_HEATMAP_DUMP_H][SCREEN_W][3];
+    memset(rgb, 0, sizeof(rgb));
+    for (int col = 0; col < ray_column_count; col++) {
+        uint64_t traverse = column_traverse_ticks[col], shade = column_shade_ticks[col];
+        Color c = heat_color((float)(traverse + shade) / max);
+        Color light = ColorBrightness(c, 0.5);
+        int traverse_h = traverse * COST_HEATMAP_DUMP_H / max;
+        int bar_h = (traverse + shade) * COST_HEATMAP_DUMP_H / max;
+        for (int y = 0; y < bar_h; y++) {
+            Color px = y < traverse_h ? c : light;
+            for (int x = ray_columns[col].x; x < ray_columns[col].x + ray_columns[col].w; x++) {
+                uint8_t *out = rgb[COST_HEATMAP_DUMP_H - 1 - y][x];
+                out[0] = px.r;
+                out[1] = px.g;
+                out[2] = px.b;
+            }
+        }
+    }
+    fprintf(f, "P6\n%d %d\n255\n", SCREEN_W, COST_HEATMAP_DUMP_H);
+    fwrite(rgb, 1, sizeof(rgb), f);
+    fclose(f);
+    printf("cost: column heatmap written to %s\n", COST_HEATMAP_FILE);
+}
+#endif
+#endif
+
+typedef struct {
+    float depth; // raycast_walls units
+    Vector2 pos;
+    uint16_t index;
+} SpriteProj;
+
+static SpriteProj visible_sprites[MAX_ENTITIES];
+
+// Frustum culling on the spatial hash: a cell is skipped, with everything in
+// it, when its box grown by the sprite half size is behind, beyond the
+// render distance or fully outside one of the two side planes.
+static bool cell_in_view(Player p, Vector2 l, Vector2 r, float x0, float y0, float x1, float y1) {
+    Vector2 corners[4] = {{x0, y0}, {x1, y0}, {x0, y1}, {x1, y1}};
+    int behind = 0, far = 0, out_l = 0, out_r = 0;
+    for (int k = 0; k < 4; k++) {
+        Vector2 q = Vector2Subtract(corners[k], p.pos);
+        float depth = Vector2DotProduct(q, p.dir);
+        if (depth <= 0.0) behind++;
+        if (depth > MAX_RENDER_DIST) far++;
+        if (l.x * q.y - l.y * q.x < 0.0) out_l++;
+        if (q.x * r.y - q.y * r.x < 0.0) out_r++;
+    }
+    return behind < 4 && far < 4 && out_l < 4 && out_r < 4;
+}
+
+int entities_visible(const Entities *e, Player p, float alpha, SpriteProj *out) {
+    Vector2 l = Vector2Rotate(p.dir, -FOV_ANGLE / 2.0);
+    Vector2 r = Vector2Rotate(p.dir, FOV_ANGLE / 2.0);
+    float m = ENTITY_SIZE / 2.0;
+    int n = 0;
+    for (int b = 0; b < ENTITY_BUCKETS; b++) {
+        if (e->cell_start[b] == e->cell_start[b + 1]) continue;
+        if (b < ROWS * COLS) {
+            float cx = b % COLS, cy = b / COLS;
+            if (!cell_in_view(p, l, r, cx - m, cy - m, cx + 1 + m, cy + 1 + m)) continue;
+        }
+        for (int k = e->cell_start[b]; k < e->cell_start[b + 1]; k++) {
+            int i = e->cell_items[k];
+            Vector2 pos = {
+                e->prev_x[i] + (e->pos_x[i] - e->prev_x[i]) * alpha,
+                e->prev_y[i] + (e->pos_y[i] - e->prev_y[i]) * alpha,
+            };
+            float depth = Vector2DotProduct(Vector2Subtract(pos, p.pos), p.dir);
+            if (depth <= THRESHOLD || depth > MAX_RENDER_DIST) continue;
+            out[n++] = (SpriteProj){.depth = depth / ASPECT_RATIO, .pos = pos, .index = i};
+        }
+    }
+    return n;
+}
+
+static int sprite_far_first(const void *a, const void *b) {
+    float da = ((const SpriteProj *)a)->depth;
+    float db = ((const SpriteProj *)b)->depth;
+    return (da < db) - (da > db);
+}
+
+// moves the k nearest of the n sprites to the front, in no particular order
+static void sprites_select_nearest(SpriteProj *s, int n, int k) {
+    int lo = 0, hi = n - 1, target = k - 1;
+    while (lo < hi) {
+        float pivot = s[(lo + hi) / 2].depth;
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (s[i].depth < pivot) i++;
+            while (s[j].depth > pivot) j--;
+            if (i <= j) {
+                SpriteProj t = s[i];
+                s[i++] = s[j];
+                s[j--] = t;
+            }
+        }
+        if (target <= j) {
+            hi = j;
+        } else if (target >= i) {
+            lo = i;
+        } else {
+            return;
+        }
+    }
+}
+
+// Billboards standing on the floor. Behind the nearest wall of a ray they
+// are only drawn above it, which is exact up to the second wall. Only the
+// nearest MAX_DRAWN_SPRITES are drawn.
+void draw_sprites(Player p, float alpha) {
+    int n = entities_visible(&entities, p, alpha, visible_sprites);
+    if (n > MAX_DRAWN_SPRITES) {
+        sprites_select_nearest(visible_sprites, n, MAX_DRAWN_SPRITES);
+        n = MAX_DRAWN_SPRITES;
+    }
+    qsort(visible_sprites, n, sizeof(visible_sprites[0]), sprite_far_first);
+    Vector2 right = Vector2Rotate(p.dir, PI / 2.0);
+    for (int k = 0; k < n; k++) {
+        const SpriteProj *s = &visible_sprites[k];
+        Vector2 rel = Vector2Subtract(s->pos, p.pos);
+        float perp = s->depth * ASPECT_RATIO;
+        float angle = atan2f(Vector2DotProduct(rel, right), perp);
+        float center_x = (angle + FOV_ANGLE / 2.0) / FOV_ANGLE * SCREEN_W;
+        int w = ENTITY_SIZE * SCREEN_W / (FOV_ANGLE * perp);
+        int unit_h = RENDER_H / s->depth;
+        int h = ENTITY_SIZE * unit_h;
+        int top = (RENDER_H + unit_h) / 2 - h;
+
+        int cx = floorf(s->pos.x), cy = floorf(s->pos.y);
+        bool inside = cx >= 0 && cx < COLS && cy >= 0 && cy < ROWS;
+        int center_col = column_at_x[center_x < 0 ? 0 : center_x >= SCREEN_W ? SCREEN_W - 1 : (int)center_x];
+        float level = inside ? light_cell[cy][cx] : LIGHT_AMBIENT;
+        level = clamp_level(level + column_light_at(center_col, s->pos, ENTITY_SIZE / 2.0, Vector2Zero()));
+        Color c = shade_color(color_map[entities.sprite[s->index]], shade_scale(level, s->depth));
+
+        int x0 = center_x - w / 2;
+        int x1 = x0 + w;
+        if (x0 < 0) x0 = 0;
+        if (x1 > SCREEN_W) x1 = SCREEN_W;
+        if (x0 >= x1) continue;
+        // whole ray columns get drawn, wider than the sprite at the ends
+        const RayColumn *first = &ray_columns[column_at_x[x0]], *last = &ray_columns[column_at_x[x1 - 1]];
+        mark_dirty(first->x, last->x + last->w - first->x);
+        mark_overdrawn(first->x, last->x + last->w - first->x);
+        for (int col = column_at_x[x0]; col < ray_column_count && ray_columns[col].x < x1; col++) {
+            int bottom = top + h;
+            if (s->depth >= column_depth[col] && bottom > column_top[col]) {
+                bottom = column_top[col];
+            }
+            if (s->depth < column_masked_depth[col]) {
+                if (bottom > top) DrawViewRectangle(ray_columns[col].x, top, ray_columns[col].w, bottom - top, c);
+                continue;
+            }
+            // behind a masked wall: the rows its texels left open, above its clip
+            if (bottom > column_masked_clip[col]) bottom = column_masked_clip[col];
+            const uint32_t *bits = column_masked_bits[col];
+            for (int y = top > 0 ? top : 0; y < bottom;) {
+                if ((bits[y >> 5] >> (y & 31)) & 1) {
+                    y++;
+                    continue;
+                }
+                int start = y;
+                while (y < bottom && !((bits[y >> 5] >> (y & 31)) & 1)) y++;
+                DrawViewRectangle(ray_columns[col].x, start, ray_columns[col].w, y - start, c);
+            }
+        }
+    }
+}
+
+// sampled once per rendered frame and replayed for every tick of that frame
+uint8_t read_input() {
+    uint8_t input = 0;
+    if (IsKeyDown(KEY_W)) input |= INPUT_FORWARD;
+    if (IsKeyDown(KEY_S)) input |= INPUT_BACK;
+    if (IsKeyDown(KEY_A)) input |= INPUT_LEFT;
+    if (IsKeyDown(KEY_D)) input |= INPUT_RIGHT;
+    if (IsKeyDown(KEY_Q)) input |= INPUT_STRAFE_LEFT;
+    if (IsKeyDown(KEY_E)) input |= INPUT_STRAFE_RIGHT;
+    if (IsKeyDown(KEY_SPACE)) input |= INPUT_USE;
+    return input;
+}
+
+void move_player(Player *p, uint8_t input, float dt) {
+    if (input & INPUT_LEFT) {
+        p->dir = Vector2Rotate(p->dir, -dt * PLAYER_ROTATION_SPEED);
+    }
+    if (input & INPUT_RIGHT) {
+        p->dir = Vector2Rotate(p->dir, dt * PLAYER_ROTATION_SPEED);
+    }
+    Vector2 move = Vector2Zero();
+    if (input & INPUT_FORWARD) {
+        move = Vector2Add(move, Vector2Scale(p->dir, dt * PLAYER_SPEED));
+    }
+    if (input & INPUT_BACK) {
+        move = Vector2Add(move, Vector2Scale(p->dir, -dt * PLAYER_SPEED));
+    }
+    if (input & INPUT_STRAFE_RIGHT) {
+        move = Vector2Add(move, Vector2Scale(Vector2Rotate(p->dir, PI / 2.0), dt * PLAYER_SPEED));
+    }
+    if (input & INPUT_STRAFE_LEFT) {
+        move = Vector2Add(move, Vector2Scale(Vector2Rotate(p->dir, -PI / 2.0), dt * PLAYER_SPEED));
+    }
+    p->pos = collide_move(p->pos, move, PLAYER_RADIUS);
+}
+
+// camera pose between two simulation ticks, t in [0, 1)
+Player lerp_player(Player a, Player b, float t) {
+    Player r;
+    r.pos = Vector2Lerp(a.pos, b.pos, t);
+    r.dir = Vector2Normalize(Vector2Lerp(a.dir, b.dir, t));
+    return r;
+}
+
+#ifdef BENCHMARK
+// scripted path, one simulation tick per rendered frame so every run
+// renders exactly the same sequence of camera poses
+typedef struct {
+    int ticks;
+    uint8_t input;
+} BenchStep;
+
+static const BenchStep bench_path[] = {
+    {50, INPUT_FORWARD},
+    {75, INPUT_RIGHT},
+    {120, INPUT_FORWARD},
+    {60, INPUT_LEFT},
+    {90, INPUT_FORWARD | INPUT_LEFT},
+    {100, INPUT_STRAFE_LEFT},
+    {105, INPUT_RIGHT},
+    {30, INPUT_LEFT},
+    {120, 0}, // still, facing down row 2: a few faces cover most columns
+};
+
+#ifndef BENCH_ENTITIES
+#define BENCH_ENTITIES 1000
+#endif
+
+typedef struct {
+    int step;
+    int tick;
+    int frames;
+    long rays;
+    long span_cols;
+    double total;
+    double min;
+    double max;
+    int entity_ticks;
+    double entity_total; // entities_update time, hash rebuild included
+} Bench;
+
+static Bench bench;
+
+// xorshift, so the spawned crowd is the same on every platform
+static uint32_t bench_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+void bench_spawn_entities(Entities *e, int n) {
+    uint32_t seed = 0x2545F491;
+    for (int k = 0; k < n; k++) {
+        int x, y;
+        do {
+            x = bench_rand(&seed) % COLS;
+            y = bench_rand(&seed) % ROWS;
+        } while (map[y][x]);
+        Vector2 pos = {x + (bench_rand(&seed) % 1000) / 1000.0, y + (bench_rand(&seed) % 1000) / 1000.0};
+        if (!entity_spawn(e, pos, k % ARRAY_LEN(color_map), ENTITY_ENEMY)) break;
+    }
+    entities_build_hash(e);
+}
+
+// returns false once the path is exhausted
+bool bench_input(Bench *b, uint8_t *input) {
+    if (b->step >= (int)ARRAY_LEN(bench_path)) return false;
+    *input = bench_path[b->step].input;
+    if (++b->tick >= bench_path[b->step].ticks) {
+        b->tick = 0;
+        b->step++;
+    }
+    return true;
+}
+
+void bench_frame(Bench *b, double frame_time) {
+    if (b->frames == 0 || frame_time < b->min) b->min = frame_time;
+    if (frame_time > b->max) b->max = frame_time;
+    b->total += frame_time;
+    b->rays += frame_rays;
+    b->span_cols += frame_span_cols;
+    b->frames++;
+}
+
+void bench_report(const Bench *b) {
+    if (b->frames == 0) return;
+    printf("bench: %d frames, avg %.3f ms, min %.3f ms, max %.3f ms\n",
+        b->frames, b->total * 1000.0 / b->frames, b->min * 1000.0, b->max * 1000.0);
+    float rays = (float)b->rays / b->frames;
+    printf("bench: %.1f rays per frame, %.1f saved against one per RAY_RES column\n", rays, RAY_COLS - rays);
+    if (b->span_cols) {
+        printf("bench: %.1f columns per frame drawn from face spans\n", (float)b->span_cols / b->frames);
+    }
+    #ifndef ESP32
+    uint32_t slices = slice_cache_hits + slice_cache_misses;
+    if (slices) {
+        printf("bench: slice cache %.1f%% hits (%u of %u slices)\n",
+            slice_cache_hits * 100.0 / slices, (unsigned)slice_cache_hits, (unsigned)slices);
+    }
+    #endif
+    if (b->entity_ticks == 0) return;
+    printf("bench: %d entities, update avg %.3f us/tick\n",
+        entities.count, b->entity_total * 1000000.0 / b->entity_ticks);
+}
+#endif
+
+// =================== HUD ===================
+// Counters over the view. A widget renders its text into a small layer only
+// when its value changes, and only then are its columns sent as changed; the
+// layer is composited every frame over the freshly drawn view. The ESP32
+// shim draws text with the packed bitmap font (SetTextFont).
+#ifdef ESP32
+    #define HUD_TEXT_SIZE 7
+#else
+    #define HUD_TEXT_SIZE 20
+#endif
+#define HUD_MARGIN 2
+#define HUD_COLOR YELLOW
+
+typedef struct {
+    const char *format; // one %d for the value
+    int x, y;           // negative from the right or bottom edge
+    int digits;         // the layer fits values up to this many digits
+    int w, h;
+    int value;
+    bool drawn;         // value is on screen
+    bool tried;         // layer load attempted
+    RenderTexture2D layer;
+} HudWidget;
+
+static HudWidget hud_fps = {.format = "%d FPS", .x = -HUD_MARGIN, .y = HUD_MARGIN, .digits = 3};
+static HudWidget hud_items = {.format = "ITEMS %d", .x = HUD_MARGIN, .y = -HUD_MARGIN, .digits = 4};
+
+static int pickups = 0; // entities collected since the start
+
+static void hud_widget_draw(HudWidget *wd, int value) {
+    char text[32];
+    if (!wd->tried) {
+        int widest = 9;
+        for (int i = 1; i < wd->digits; i++) widest = widest * 10 + 9;
+        snprintf(text, sizeof(text), wd->format, widest);
+        wd->w = MeasureText(text, HUD_TEXT_SIZE);
+        wd->h = HUD_TEXT_SIZE;
+        wd->layer = LoadRenderTexture(wd->w, wd->h);
+        wd->tried = true;
+    }
+    int x = wd->x < 0 ? SCREEN_W + wd->x - wd->w : wd->x;
+    int y = wd->y < 0 ? FRAME_ROWS + wd->y - wd->h : wd->y;
+    bool changed = !wd->drawn || value != wd->value;
+    if (changed || wd->layer.id == 0) snprintf(text, sizeof(text), wd->format, value);
+    if (wd->layer.id == 0) {
+        DrawText(text, x, y, HUD_TEXT_SIZE, HUD_COLOR);
+    } else {
+        if (changed) {
+            BeginTextureMode(wd->layer);
+            ClearBackground(BLANK);
+            DrawText(text, 0, 0, HUD_TEXT_SIZE, HUD_COLOR);
+            EndTextureMode();
+        }
+        // render textures are stored bottom-up
+        Rectangle source = {0, 0, wd->w, -wd->h};
+        Vector2 position = {x, y};
+        DrawTextureKeyed(wd->layer.texture, source, position, BLANK);
+    }
+    if (changed) mark_dirty(x, wd->w);
+    mark_overdrawn(x, wd->w);
+    wd->value = value;
+    wd->drawn = true;
+}
+
+// frames counted over the last whole second
+static int hud_fps_value() {
+    static double start = 0.0;
+    static int frames = 0, fps = 0;
+    double now = GetTime();
+    frames++;
+    if (now - start >= 1.0) {
+        fps = (int)(frames / (now - start) + 0.5);
+        start = now;
+        frames = 0;
+    }
+    return fps;
+}
+
+void draw_hud() {
+    hud_widget_draw(&hud_fps, hud_fps_value());
+    hud_widget_draw(&hud_items, pickups);
+}
+
+// =================== POST-PROCESS ===================
+// Full screen color effects. The ESP32 shim applies them through a color LUT
+// while the frame goes out on SPI (SetColorLut), the host build has no
+// present hook and only keeps the state.
+
+#define DISPLAY_GAMMA 1.0
+#define FLASH_TIME 0.3 // seconds a pickup flash takes to fade out
+
+static float screen_flash = 0.0; // 1 right after a pickup, down to 0
+
+#ifdef ESP32
+static ColorLut present_lut_table;
+
+// per-channel gamma curve, blended towards white by flash
+static void color_lut_build(ColorLut *lut, float gamma, float flash) {
+    for (int v = 0; v < 64; v++) {
+        float g = powf(v / 63.0f, gamma) * (1.0 - flash) + flash;
+        lut->g[v] = (uint16_t)(g * 63.0 + 0.5) << 5;
+        if (v < 32) {
+            float rb = powf(v / 31.0f, gamma) * (1.0 - flash) + flash;
+            lut->r[v] = (uint16_t)(rb * 31.0 + 0.5) << 11;
+            lut->b[v] = (uint16_t)(rb * 31.0 + 0.5);
+        }
+    }
+}
+
+// picks the transform of the frame about to be presented
+void present_effects() {
+    // a flash recolors every pixel, not only the redrawn ones
+    static bool flashed = false;
+    if (screen_flash > 0.0 || flashed) mark_dirty(0, SCREEN_W);
+    flashed = screen_flash > 0.0;
+    if (screen_flash <= 0.0 && DISPLAY_GAMMA == 1.0) {
+        SetColorLut(NULL);
+        return;
+    }
+    color_lut_build(&present_lut_table, DISPLAY_GAMMA, screen_flash * 0.6);
+    SetColorLut(&present_lut_table);
+}
+#endif
+
+static uint32_t sim_ticks = 0;
+
+void game_tick(Player *p, uint8_t input) {
+    sim_ticks++;
+    textures_animate(sim_ticks * SIM_DT);
+    move_player(p, input, SIM_DT);
+    if (input & INPUT_USE) player_use(p);
+    doors_update(p->pos, SIM_DT);
+    pushwalls_update(SIM_DT);
+    flow_update(&flow, p->pos);
+    #ifdef BENCHMARK
+    double entity_start = GetTime();
+    #endif
+    TRACE_BEGIN(entities_update);
+    entities_update(&entities, &flow, p->pos, SIM_DT);
+    TRACE_END(entities_update);
+    #ifdef BENCHMARK
+    bench.entity_total += GetTime() - entity_start;
+    bench.entity_ticks++;
+    #endif
+    int collected = entities_collect(&entities, p->pos, PLAYER_RADIUS);
+    if (collected) {
+        pickups += collected;
+        // pickup flash
+        light_add((DynamicLight){.light = {p->pos, 40.0, 4.0}, .z = EYE_HEIGHT, .fade = 80.0});
+        screen_flash = 1.0;
+    }
+    if (screen_flash > 0.0) screen_flash -= SIM_DT / FLASH_TIME;
+    lights_update(SIM_DT);
+}
+
+#ifdef COALESCE_SPANS
+// Runs of columns meeting the same wall face first are found by bisection:
+// probes every SPAN_COLS columns, then the middle of each span, until both
+// ends and the middle agree. The columns in between then take their first
+// hit from the face plane instead of walking the grid up to it.
+#define SPAN_COLS 16
+
+static RayHit column_probe(Player p, int col) {
+    RayWalk w;
+    RayHit hit;
+    ray_begin(&w, p.pos, column_dir(p, col));
+    frame_rays++;
+    #ifdef COST_COUNTERS
+    uint64_t cells_start = cost.cells;
+    #endif
+    if (!ray_next(&w, MAX_RENDER_DIST, &hit)) hit.value = 0;
+    #ifdef COST_COUNTERS
+    cost_probe_cells = cost.cells - cells_start;
+    #endif
+    return hit;
+}
+
+// doors and moving pushwalls are not flat across their cell
+static bool same_face(const RayHit *a, const RayHit *b) {
+    return a->value && b->value && a->cell_x == b->cell_x && a->cell_y == b->cell_y && a->face == b->face &&
+        !(map_flags[a->cell_y][a->cell_x] & (CELL_DOOR | CELL_PARTIAL));
+}
+
+// where the ray of col meets the plane of the face of hit
+static RayHit face_hit(Player p, int col, const RayHit *face) {
+    Vector2 dir = column_dir(p, col);
+    RayHit hit = *face;
+    if (face->side == 0) {
+        float x = face->cell_x + (face->face == FACE_EAST);
+        hit.dist = (x - p.pos.x) / dir.x;
+        hit.u = 1.0 - (p.pos.y + dir.y * hit.dist - face->cell_y);
+    } else {
+        float y = face->cell_y + (face->face == FACE_SOUTH);
+        hit.dist = (y - p.pos.y) / dir.y;
+        hit.u = p.pos.x + dir.x * hit.dist - face->cell_x;
+    }
+    if (hit.u < 0.0) hit.u = 0.0;
+    if (hit.u > 0.999) hit.u = 0.999;
+    return hit;
+}
+
+// columns strictly between cast[i0] and cast[i1], whose first hits are a and b
+static void cast_span(Player p, const int *cast, int i0, const RayHit *a, int i1, const RayHit *b) {
+    if (i1 - i0 < 2) return;
+    int m = (i0 + i1) / 2;
+    RayHit mid = column_probe(p, cast[m]);
+    raycast_walls(p, cast[m], &mid);
+    if (same_face(a, b) && same_face(a, &mid)) {
+        for (int i = i0 + 1; i < i1; i++) {
+            if (i == m) continue;
+            RayHit hit = face_hit(p, cast[i], a);
+            raycast_walls(p, cast[i], &hit);
+            frame_span_cols++;
+        }
+        return;
+    }
+    cast_span(p, cast, i0, a, m, &mid);
+    cast_span(p, cast, m, &mid, i1, b);
+}
+
+static void cast_spans(Player p, const int *cast, int n) {
+    if (n == 0) return;
+    RayHit a = column_probe(p, cast[0]);
+    raycast_walls(p, cast[0], &a);
+    for (int i0 = 0; i0 < n - 1;) {
+        int i1 = i0 + SPAN_COLS < n - 1 ? i0 + SPAN_COLS : n - 1;
+        RayHit b = column_probe(p, cast[i1]);
+        raycast_walls(p, cast[i1], &b);
+        cast_span(p, cast, i0, &a, i1, &b);
+        a = b;
+        i0 = i1;
+    }
+}
+#endif
+
+void draw_walls(Player p) {
+    light_cull_columns(p);
+    int x0 = 0, x1 = SCREEN_W; // cast whatever the parity
+    #if INTERLACE > 1
+    interlace_scroll(p, &x0, &x1);
+    #endif
+    frame_rays = 0;
+    frame_span_cols = 0;
+    #ifdef DEBUG
+    minimap_ray_count = 0;
+    #endif
+    #ifndef ESP32
+    slice_cache_frame++;
+    #endif
+    static int cast[RAY_COLS];
+    int n = 0;
+    for (int col = 0; col < ray_column_count; col++) {
+        const RayColumn *rc = &ray_columns[col];
+        bool kept = col % INTERLACE != interlace_field && (rc->x + rc->w <= x0 || rc->x >= x1);
+        #if INTERLACE > 1
+        if (kept && column_overdrawn(rc)) kept = false;
+        #endif
+        if (kept) continue;
+        cast[n++] = col;
+        mark_dirty(rc->x, rc->w);
+    }
+    #if INTERLACE > 1
+    memset(interlace_overdrawn, false, sizeof(interlace_overdrawn));
+    #endif
+    #ifdef COALESCE_SPANS
+    cast_spans(p, cast, n);
+    #else
+    for (int i = 0; i < n; i++) {
+        raycast_walls(p, cast[i], NULL);
+    }
+    #endif
+    interlace_field = (interlace_field + 1) % INTERLACE;
+}
+
+#ifdef ESP32
+int app_main()
+#else
+int main()
+#endif
+{
+    init_game();
+    ray_columns_init();
+    InitWindow(SCREEN_W, SCREEN_H, "ray");
+    #ifdef ESP32
+    SetTextFont(&assets_font[ft_font]);
+    #endif
+    #ifdef BENCHMARK
+    SetTargetFPS(0);
+    bench_spawn_entities(&entities, BENCH_ENTITIES);
+    #else
+    SetTargetFPS(TARGET_FPS);
+    #endif
+    SetConfigFlags(FLAG_MSAA_4X_HINT);
+    Player p = {.pos = {.x = 0.2, .y = 1.3}, .dir = {.x = 1, .y = 0}};
+    Player prev_p = p;
+    float accumulator = 0.0;
+
+    while (!WindowShouldClose()) {
+        TRACE_BEGIN(frame);
+        #ifdef BENCHMARK
+        double frame_start = GetTime();
+        uint8_t input;
+        if (!bench_input(&bench, &input)) break;
+        accumulator += SIM_DT;
+        #else
+        uint8_t input = read_input();
+        float frame_time = GetFrameTime();
+        if (frame_time > SIM_MAX_STEPS * SIM_DT) frame_time = SIM_MAX_STEPS * SIM_DT;
+        accumulator += frame_time;
+        #endif
+        while (accumulator >= SIM_DT) {
+            prev_p = p;
+            TRACE_BEGIN(game_tick);
+            game_tick(&p, input);
+            TRACE_END(game_tick);
+            accumulator -= SIM_DT;
+        }
+        float alpha = accumulator / SIM_DT;
+        Player view = lerp_player(prev_p, p, alpha);
+
+        #ifdef COST_COUNTERS
+        cost_frame_begin();
+        #endif
+        BeginDrawing();
+        TRACE_BEGIN(draw_walls);
+        draw_walls(view);
+        TRACE_END(draw_walls);
+        TRACE_BEGIN(draw_sprites);
+        draw_sprites(view, alpha);
+        TRACE_END(draw_sprites);
+        #ifdef DEBUG
+        draw_minimap();
+        draw_minimap_rays(view.pos);
+        draw_minimap_flow(&flow);
+        draw_minimap_entities(&entities);
+        draw_minimap_player(view.pos);
+        mark_dirty(0, COLS * MINIMAP_CELL_SCALE + 1);
+        mark_overdrawn(0, COLS * MINIMAP_CELL_SCALE + 1);
+        #endif
+        #ifdef COST_HEATMAP
+        draw_cost_heatmap();
+        #endif
+        draw_hud();
+        #ifdef ESP32
+        present_effects();
+        #endif
+        #ifdef COST_COUNTERS
+        cost_frame_drawn();
+        #endif
+        TRACE_BEGIN(present);
+        EndDrawing();
+        TRACE_END(present);
+        #ifdef COST_COUNTERS
+        cost_frame_end();
+        #endif
+        #ifdef BENCHMARK
+        bench_frame(&bench, GetTime() - frame_start);
+        #endif
+        TRACE_END(frame);
+        TRACE_NEXT_FRAME();
     }
+    #ifdef BENCHMARK
+    bench_report(&bench);
+    #endif
+    #ifdef COST_COUNTERS
+    cost_report();
+    #endif
+    #if defined(COST_HEATMAP) && !defined(ESP32)
+    cost_heatmap_dump();
+    #endif
+    #ifdef TRACE
+    trace_write();
+    #endif
     return 0;
 }
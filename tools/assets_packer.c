@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <ctype.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define DS_IMPLEMENTATION
@@ -6,6 +7,125 @@
 #include "ds.h"
 
 da_declare(StringArr, char*);
+da_declare(BoolArr, bool);
+
+typedef struct {
+  char *base;  // animation name, "water" for water_3.png
+  int index;
+  char *name;  // name of the frame texture
+  bool masked;
+} AnimFrame;
+da_declare(AnimFrameArr, AnimFrame);
+
+#define ALPHA_OPAQUE 128
+#define PANORAMA_SUFFIX ".pano"
+#define ANIM_FPS_SUFFIX ".fps"
+#define ANIM_DEFAULT_FPS 8.0
+#define FONT_SUFFIX ".font"
+#define FONT_FIRST 32  // fonts are a strip of cells for the printable ASCII
+#define FONT_GLYPHS 95
+
+// 1-bit column masks of a font strip, bit row set where the texel is opaque and
+// bright: FONT_GLYPHS cells of x / FONT_GLYPHS columns, spacing included.
+void generate_font(String *buffer, const char *name, uint8_t *bitmap, int x, int y, int ch) {
+  int cell_w = x / FONT_GLYPHS;
+  str_appendf(buffer, "static const uint16_t %s_glyphs[] = {\n", name);
+  for(int glyph = 0; glyph < FONT_GLYPHS; glyph++) {
+    str_append(buffer, "    ");
+    for(int col = 0; col < cell_w; col++) {
+      uint16_t bits = 0;
+      for(int row = 0; row < y && row < 16; row++) {
+        uint8_t *p = &bitmap[(row * x + glyph * cell_w + col) * ch];
+        bool opaque = ch != 4 || p[3] >= ALPHA_OPAQUE;
+        int luma = ch >= 3 ? (p[0] + 2 * p[1] + p[2]) / 4 : p[0];
+        if (opaque && luma >= 128) bits |= 1 << row;
+      }
+      str_appendf(buffer, "0x%04x,%s", bits, col != cell_w - 1 ? " " : "");
+    }
+    str_appendf(buffer, " // '%c'\n", FONT_FIRST + glyph);
+  }
+  str_append(buffer, "};\n");
+}
+
+bool has_transparency(uint8_t *bitmap, int x, int y, int ch) {
+  if (ch != 4) return false;
+  for(int i = 0; i < x * y; i++) {
+    if (bitmap[i * ch + 3] < ALPHA_OPAQUE) return true;
+  }
+  return false;
+}
+
+// Opaque runs of every texture column: runs[index[column]] holds the run count
+// followed by (first, last + 1) row pairs. Masked walls only draw these rows.
+void generate_mask(String *buffer, const char *name, uint8_t *bitmap, int x, int y, int ch) {
+  String runs = {0};
+  int offset = 0;
+  str_appendf(buffer, "static const uint16_t %s_mask_index[] = {\n    ", name);
+  for(int col = 0; col < x; col++) {
+    str_appendf(buffer, "%d", offset);
+    str_append(buffer, col % 8 == 7 ? (col != x - 1 ? ",\n    " : ", ") : ", ");
+
+    int n = 0;
+    String col_runs = {0};
+    for(int row = 0; row < y;) {
+      if (bitmap[(row * x + col) * ch + 3] < ALPHA_OPAQUE) {
+        row++;
+        continue;
+      }
+      int first = row;
+      while(row < y && bitmap[(row * x + col) * ch + 3] >= ALPHA_OPAQUE) row++;
+      str_appendf(&col_runs, " %d, %d,", first, row);
+      n++;
+    }
+    str_appendf(&runs, "    %d,%s\n", n, col_runs.data ? col_runs.data : "");
+    offset += 1 + 2 * n;
+  }
+  str_append(buffer, "\n};\n");
+  str_appendf(buffer, "static const uint8_t %s_mask_runs[] = {\n%s};\n", name, runs.data);
+  str_appendf(buffer, "static const TextureMask %s_mask = {%s_mask_index, %s_mask_runs};\n", name, name, name);
+}
+
+// Panoramas are stored column-major, so a screen column of sky is a straight
+// copy of consecutive texels.
+uint8_t *transpose(uint8_t *bitmap, int x, int y, int ch) {
+  uint8_t *out = malloc(x * y * ch);
+  for(int row = 0; row < y; row++) {
+    for(int col = 0; col < x; col++) {
+      memcpy(&out[(col * y + row) * ch], &bitmap[(row * x + col) * ch], ch);
+    }
+  }
+  return out;
+}
+
+// "water_3" is frame 3 of the animation "water", -1 for any other name
+int anim_frame_index(const char *name, char **base) {
+  const char *sep = strrchr(name, '_');
+  if (!sep || !sep[1]) return -1;
+  for(const char *p = sep + 1; *p; p++) {
+    if (!isdigit((unsigned char)*p)) return -1;
+  }
+  *base = strndup(name, sep - name);
+  return atoi(sep + 1);
+}
+
+int anim_frame_cmp(const void *a, const void *b) {
+  const AnimFrame *fa = a, *fb = b;
+  int c = strcmp(fa->base, fb->base);
+  return c ? c : fa->index - fb->index;
+}
+
+// frame rate from an optional <name>.fps file next to the frames
+float anim_fps(const char *dir, const char *base) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s%s", dir, base, ANIM_FPS_SUFFIX);
+  FILE *f = fopen(path, "r");
+  float fps = ANIM_DEFAULT_FPS;
+  if (f) {
+    if (fscanf(f, "%f", &fps) != 1 || fps <= 0) fps = ANIM_DEFAULT_FPS;
+    fclose(f);
+  }
+  return fps;
+}
 
 void generate_rgb_32(String *buffer, const char *name, uint8_t *bitmap, int x, int y, int ch) {
   str_appendf(buffer, "static const pixel_t %s[] = { \n   ", name);
@@ -56,6 +176,13 @@ int main(int argc, char **argv) {
     }
     String out = {0};
     StringArr assets = {0};
+    BoolArr masked = {0};
+    StringArr first_frame = {0};
+    AnimFrameArr frames = {0};
+    StringArr panoramas = {0};
+    String panorama_sizes = {0};
+    StringArr fonts = {0};
+    String font_sizes = {0};
     str_append(&out, "// File generated automatically by assets_packer.c. DO NOT EDIT. \n");
     str_append(&out, "#ifndef ASSETS_H\n");
     str_append(&out, "#define ASSETS_H\n");
@@ -66,6 +193,29 @@ int main(int argc, char **argv) {
     str_append(&out, "#else\n");
     str_append(&out, "typedef uint32_t pixel_t;\n");
     str_append(&out, "#endif\n\n");
+    str_append(&out, "typedef struct {\n");
+    str_append(&out, "    const uint16_t *index; // per texture column, offset of its entry in runs\n");
+    str_append(&out, "    const uint8_t *runs;   // run count, then (first, last + 1) opaque row pairs\n");
+    str_append(&out, "} TextureMask;\n\n");
+    str_append(&out, "typedef struct {\n");
+    str_append(&out, "    const pixel_t *columns; // column-major, w columns of h texels\n");
+    str_append(&out, "    int w, h;\n");
+    str_append(&out, "} Panorama;\n\n");
+    str_append(&out, "typedef struct {\n");
+    str_append(&out, "    const pixel_t *const *frames;\n");
+    str_append(&out, "    const TextureMask *const *masks; // NULL entries for opaque frames\n");
+    str_append(&out, "    int count;\n");
+    str_append(&out, "    float fps;\n");
+    str_append(&out, "} TextureAnim;\n\n");
+    // the ESP32 raylib shim declares the same struct for its DrawText
+    str_append(&out, "#ifndef BITMAP_FONT_TYPE\n");
+    str_append(&out, "#define BITMAP_FONT_TYPE\n");
+    str_append(&out, "typedef struct {\n");
+    str_append(&out, "    const uint16_t *glyphs; // w column masks per glyph, bit y set where row y is lit\n");
+    str_append(&out, "    int first, count;       // character codes covered\n");
+    str_append(&out, "    int w, h;               // cell size, spacing included\n");
+    str_append(&out, "} BitmapFont;\n");
+    str_append(&out, "#endif\n\n");
 
     DIR *d = opendir(argv[1]);
     struct dirent *dir;
@@ -79,7 +229,14 @@ int main(int argc, char **argv) {
         char *name = strdup(dir->d_name);
         char *c=strrchr(name, '.');
         *c = 0;
-        da_append(&assets, name);
+        bool is_panorama = ends_with(name, PANORAMA_SUFFIX);
+        if (is_panorama) {
+            name[strlen(name) - strlen(PANORAMA_SUFFIX)] = 0;
+        }
+        bool is_font = ends_with(name, FONT_SUFFIX);
+        if (is_font) {
+            name[strlen(name) - strlen(FONT_SUFFIX)] = 0;
+        }
 
         int x, y, ch;
         char cfile[256] = {0};
@@ -95,14 +252,82 @@ int main(int argc, char **argv) {
         }
 
         str_appendf(&out, "// %s\n", dir->d_name);
+        if (is_panorama) {
+            uint8_t *columns = transpose(bitmap, x, y, ch);
+            char columns_name[256];
+            snprintf(columns_name, sizeof(columns_name), "%s_columns", name);
+            str_append(&out, "#ifdef ESP32\n");
+            generate_rgb_565(&out, columns_name, columns, x, y, ch);
+            str_append(&out, "#else\n");
+            generate_rgb_32(&out, columns_name, columns, x, y, ch);
+            str_append(&out, "#endif\n\n");
+            free(columns);
+            da_append(&panoramas, name);
+            str_appendf(&panorama_sizes, "    {%s_columns, %d, %d},\n", name, x, y);
+            continue;
+        }
+        if (is_font) {
+            if (x % FONT_GLYPHS || y > 16) {
+                log_error("Font %s must be %d cells wide and at most 16 rows\n", cfile, FONT_GLYPHS);
+                exit(1);
+            }
+            generate_font(&out, name, bitmap, x, y, ch);
+            str_append(&out, "\n");
+            da_append(&fonts, name);
+            str_appendf(&font_sizes, "    {%s_glyphs, %d, %d, %d, %d},\n", name, FONT_FIRST, FONT_GLYPHS, x / FONT_GLYPHS, y);
+            continue;
+        }
         str_append(&out, "#ifdef ESP32\n");
         generate_rgb_565(&out, name, bitmap, x, y, ch);
         str_append(&out, "#else\n");
         generate_rgb_32(&out, name, bitmap, x, y, ch);
-        str_append(&out, "#endif\n\n");
+        str_append(&out, "#endif\n");
+        bool is_masked = has_transparency(bitmap, x, y, ch);
+        if (is_masked) generate_mask(&out, name, bitmap, x, y, ch);
+        str_append(&out, "\n");
+
+        char *base;
+        int index = anim_frame_index(name, &base);
+        if (index >= 0) {
+            da_append(&frames, ((AnimFrame){base, index, name, is_masked}));
+        } else {
+            da_append(&assets, name);
+            da_append(&first_frame, name);
+            da_append(&masked, is_masked);
+        }
     }
     closedir(d);
 
+    // frames named <name>_<n> make one texture, tx_<name>, starting on its first frame
+    if (frames.length) qsort(frames.data, frames.length, sizeof(AnimFrame), anim_frame_cmp);
+    size_t anim_start = assets.length;
+    for(size_t i = 0; i < frames.length;) {
+        size_t j = i;
+        while (j < frames.length && strcmp(frames.data[j].base, frames.data[i].base) == 0) j++;
+        const char *base = frames.data[i].base;
+        str_appendf(&out, "static const pixel_t *const %s_frames[] = {", base);
+        for(size_t k = i; k < j; k++) {
+            str_appendf(&out, "%s%s", frames.data[k].name, k + 1 < j ? ", " : "");
+        }
+        str_append(&out, "};\n");
+        str_appendf(&out, "static const TextureMask *const %s_frame_masks[] = {", base);
+        for(size_t k = i; k < j; k++) {
+            if (frames.data[k].masked) {
+                str_appendf(&out, "&%s_mask", frames.data[k].name);
+            } else {
+                str_append(&out, "NULL");
+            }
+            str_append(&out, k + 1 < j ? ", " : "");
+        }
+        str_append(&out, "};\n");
+        str_appendf(&out, "static const TextureAnim %s_anim = {%s_frames, %s_frame_masks, %d, %.2ff};\n\n",
+            base, base, base, (int)(j - i), anim_fps(argv[1], base));
+        da_append(&assets, (char*)base);
+        da_append(&first_frame, frames.data[i].name);
+        da_append(&masked, frames.data[i].masked);
+        i = j;
+    }
+
     str_append(&out, "typedef enum {\n");
     str_append(&out, "    NULL_ASSET,\n");
     da_foreach_idx(&assets, i) {
@@ -110,11 +335,58 @@ int main(int argc, char **argv) {
     }
     str_append(&out, "} TextureId;\n\n");
 
+    str_append(&out, "// animated textures point to their current frame here\n");
     str_append(&out, "const pixel_t *assets_map[] = {\n");
     str_append(&out, "    NULL,\n");
+    da_foreach_idx(&first_frame, i) {
+        str_appendf(&out, "    %s,\n", first_frame.data[i]);
+    }
+    str_append(&out, "};\n\n");
+
+    str_append(&out, "// opaque runs of textures with transparent texels, NULL for opaque ones\n");
+    str_append(&out, "const TextureMask *assets_mask[] = {\n");
+    str_append(&out, "    NULL,\n");
+    da_foreach_idx(&masked, i) {
+        if (masked.data[i]) {
+            str_appendf(&out, "    &%s_mask,\n", first_frame.data[i]);
+        } else {
+            str_append(&out, "    NULL,\n");
+        }
+    }
+    str_append(&out, "};\n\n");
+
+    str_append(&out, "// frames of animated textures, NULL for still ones\n");
+    str_append(&out, "const TextureAnim *assets_anim[] = {\n");
+    str_append(&out, "    NULL,\n");
     da_foreach_idx(&assets, i) {
-        str_appendf(&out, "    %s,\n", assets.data[i]);
+        if (i >= anim_start) {
+            str_appendf(&out, "    &%s_anim,\n", assets.data[i]);
+        } else {
+            str_append(&out, "    NULL,\n");
+        }
+    }
+    str_append(&out, "};\n\n");
+
+    str_append(&out, "typedef enum {\n");
+    da_foreach_idx(&panoramas, i) {
+        str_appendf(&out, "    pn_%s,\n", panoramas.data[i]);
     }
+    str_append(&out, "    PANORAMA_COUNT\n");
+    str_append(&out, "} PanoramaId;\n\n");
+
+    str_append(&out, "const Panorama assets_panorama[] = {\n");
+    str_append(&out, panorama_sizes.data ? panorama_sizes.data : "    {NULL, 0, 0},\n");
+    str_append(&out, "};\n\n");
+
+    str_append(&out, "typedef enum {\n");
+    da_foreach_idx(&fonts, i) {
+        str_appendf(&out, "    ft_%s,\n", fonts.data[i]);
+    }
+    str_append(&out, "    FONT_COUNT\n");
+    str_append(&out, "} FontId;\n\n");
+
+    str_append(&out, "const BitmapFont assets_font[] = {\n");
+    str_append(&out, font_sizes.data ? font_sizes.data : "    {NULL, 0, 0, 0, 0},\n");
     str_append(&out, "};\n");
     str_append(&out, "#endif //ASSETS_H");
 